@@ -28,6 +28,8 @@
 
 #define MAX_THREADS       64
 
+#define POOL_SIZE         (4UL << 30) /* Size of a new pool directory file */
+
 #define ENABLE_VALIDATION 0
 
 /*
@@ -285,18 +285,52 @@ init(p_llist_t *p_list)
     pmem_memset_persist(p_list->tlog, 0, MAX_THREADS * sizeof(tlog_t));
 }
 
-/* Create new linked list. */
-p_llist_t *
-p_list_new()
+/* Recover or init a list whose magic no. is at the start of p_ptr. */
+static void
+p_list_attach(p_llist_t *p_list, char *p_ptr)
 {
-    char *p_ptr;
-    char pmem_path[PATH_MAX];
+    uint64_t *magic = (uint64_t *)p_ptr;
+
+    /* Check if we should recover. */
+    if (*magic == LL_MAGIC) {
+        /* Recover internal state. */
+        recover(p_list);
+    } else {
+        /* Init internal state. */
+        init(p_list);
+
+        /* Set magic no. */
+        *magic = LL_MAGIC;
+        persist(magic, sizeof(uint64_t));
+    }
+
+#ifdef DEBUG
+    p_list_print(p_list);
+#endif
+}
 
+/* Allocate the volatile part of a list. */
+static p_llist_t *
+p_list_alloc()
+{
     p_llist_t *p_list;
     posix_memalign(&p_list, getpagesize(), sizeof(p_llist_t));
 
     /* Init bitmap. */
     BM_INIT(p_list->bm, LL_SIZE);
+    p_list->pool = NULL;
+
+    return p_list;
+}
+
+/* Create new linked list. */
+p_llist_t *
+p_list_new()
+{
+    char *p_ptr;
+    char pmem_path[PATH_MAX];
+
+    p_llist_t *p_list = p_list_alloc();
 
     /* Init per-thread logs. */
     snprintf(pmem_path, PATH_MAX, "%s/%s", PMEM_DAXFS_PATH, "tlog");
@@ -307,27 +341,38 @@ p_list_new()
     snprintf(pmem_path, PATH_MAX, "%s/%s", PMEM_DAXFS_PATH, "p_llist");
     p_ptr = (char *)pmempool_alloc(pmem_path, getpagesize() +
                                    (LL_SIZE * sizeof(p_node_t)));
-
-    uint64_t *magic = (uint64_t *)p_ptr;
     p_list->node_arr = (p_node_t *)(p_ptr + getpagesize());
 
-    /* Check if we should recover. */
-    if (*magic == LL_MAGIC) {
-        /* Recover internal state. */
-        recover(p_list);
-    } else {
-        /* Init internal state. */
-        init(p_list);
+    p_list_attach(p_list, p_ptr);
+    return p_list;
+}
 
-        /* Set magic no. */
-        *magic = LL_MAGIC;
-        persist(magic, sizeof(uint64_t));
-    }
+/* Size of the per-thread logs of a list in a pool directory. */
+#define TLOG_AREA roundup(MAX_THREADS * sizeof(tlog_t), getpagesize())
 
-#ifdef DEBUG
-    p_list_print(p_list);
-#endif
+/*
+ * Open the list called name in a pool directory, creating it if needed.
+ * The region holds the magic no. page, the per-thread logs and the node
+ * array. Returns NULL if name exists with a different geometry.
+ */
+p_llist_t *
+p_list_open(pool_dir_t *pool, const char *name)
+{
+    uint64_t geom[POOL_GEOM_LEN] = {LL_SIZE, sizeof(p_node_t), MAX_THREADS,
+                                    EADR_AVAILABLE
+                                   };
+    size_t size = getpagesize() + TLOG_AREA + LL_SIZE * sizeof(p_node_t);
+
+    char *p_ptr = (char *)pool_dir_get(pool, name, LL_MAGIC, geom, size);
+    if (!p_ptr)
+        return NULL;
 
+    p_llist_t *p_list = p_list_alloc();
+    p_list->pool = pool;
+    p_list->tlog = (tlog_t *)(p_ptr + getpagesize());
+    p_list->node_arr = (p_node_t *)(p_ptr + getpagesize() + TLOG_AREA);
+
+    p_list_attach(p_list, p_ptr);
     return p_list;
 }
 
@@ -348,6 +393,14 @@ p_list_del(p_llist_t *p_list)
         printf("Search Latency    : %f (cycles)\n",
                t_search_tot * 1.0 / n_search_tot);
 
+    if (p_list->pool) {
+        /* The pool owns the mapping. */
+        SFENCE();
+        persist_eadr(p_list->node_arr, LL_SIZE * sizeof(p_node_t));
+        free(p_list);
+        return;
+    }
+
     p_ptr = (char *)p_list->node_arr - getpagesize();
     pmem_size = getpagesize() + (LL_SIZE * sizeof(p_node_t));
     SFENCE();
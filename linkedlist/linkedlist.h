@@ -23,6 +23,7 @@
 #include "atomic_ops_if.h"
 #include "utils.h"
 #include "lock_if.h"
+#include "pool_dir.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -66,7 +67,10 @@ typedef struct p_llist {
     /* Per-thread logs */
     tlog_t *tlog;
 
-    uint8_t pad[32];
+    /* Pool hosting the list, NULL if it has its own files */
+    pool_dir_t *pool;
+
+    uint8_t pad[24];
 
     /* List size */
     uint64_t size;
@@ -74,6 +78,8 @@ typedef struct p_llist {
 
 /* create new linked list */
 p_llist_t *p_list_new();
+/* open or create the linked list called name in a pool directory */
+p_llist_t *p_list_open(pool_dir_t *pool, const char *name);
 /* delete linked list */
 void p_list_del(p_llist_t *p_list);
 /* return 0 if not found, positive number otherwise */
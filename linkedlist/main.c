@@ -25,6 +25,8 @@
 #include "random.h"
 #include "timer.h"
 
+#include <linux/limits.h>
+
 #define XSTR(s)                         STR(s)
 #define STR(s)                          #s
 
@@ -225,15 +227,18 @@ main(int argc, char *const argv[])
         {"initial",                   required_argument, NULL, 'i'},
         {"num-threads",               required_argument, NULL, 'n'},
         {"updates",                   required_argument, NULL, 'u'},
+        {"pool",                      required_argument, NULL, 'p'},
         {NULL, 0, NULL, 0}
     };
 
     int i, c;
+    char *pool_name = NULL;
+    pool_dir_t *pool = NULL;
 
     //actually get the parameters form the command-line
     while (1) {
         i = 0;
-        c = getopt_long(argc, argv, "hd:r:i:n:u:", long_options, &i);
+        c = getopt_long(argc, argv, "hd:r:i:n:u:p:", long_options, &i);
 
         if (c == -1)
             break;
@@ -262,7 +267,9 @@ main(int argc, char *const argv[])
                    "  -r, --range <int>\n"
                    "        Key range (default=" XSTR(DEFAULT_RANGE) ")\n"
                    "  -n, --num-threads <int>\n"
-                   "        Number of threads (default=" XSTR(DEFAULT_NUM_THREADS) ")\n",
+                   "        Number of threads (default=" XSTR(DEFAULT_NUM_THREADS) ")\n"
+                   "  -p, --pool <name>\n"
+                   "        Use the list called name in the shared pool file\n",
                    argv[0]);
             exit(0);
         case 'd':
@@ -280,6 +287,9 @@ main(int argc, char *const argv[])
             updates = atoi(optarg);
             finds = 100 - updates;
             break;
+        case 'p':
+            pool_name = optarg;
+            break;
         case '?':
             printf("Use -h or --help for help\n");
             exit(0);
@@ -294,7 +304,18 @@ main(int argc, char *const argv[])
     max_key = pow2roundup(max_key) - 1;
 
     //initialization of the list
-    p_list = p_list_new();
+    if (pool_name) {
+        char pool_path[PATH_MAX];
+        snprintf(pool_path, PATH_MAX, "%s/%s", PMEM_DAXFS_PATH, "pool");
+        pool = pool_dir_open(pool_path, POOL_SIZE);
+        p_list = pool ? p_list_open(pool, pool_name) : NULL;
+        if (p_list == NULL) {
+            fprintf(stderr, "Cannot open list %s in %s\n", pool_name, pool_path);
+            exit(1);
+        }
+    } else {
+        p_list = p_list_new();
+    }
 
     //initial size
     unsigned long init_size = p_list_size(p_list);
@@ -414,6 +435,8 @@ main(int argc, char *const argv[])
     free(threads);
     free(data);
     p_list_del(p_list);
+    if (pool)
+        pool_dir_close(pool);
 
     return 0;
 }
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_BENCH_H
+#define Q_BENCH_H
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "timer.h"
+#include "placement.h"
+#include "histogram.h"
+#include "pool_dir.h"
+#include "util.h"
+#include "test_common.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Runtime-configurable benchmark.
+ *
+ * p_rb_q_bench.x runs one measurement point per persistence policy with
+ * the thread counts, sizes and run length given on the command line and
+ * prints the results as one JSON object each, so sweeps need no rebuild.
+ * Slot and queue sizes are template parameters of the queue, so only the
+ * sizes listed in bench_dispatch() are compiled in.
+ * ------------------------------------------------------------------------
+ */
+struct BenchOpts {
+    const char    *policies;   // Comma-separated policy names, or "all"
+    const char    *policy;     // Policy of the current run
+    size_t        producers, consumers, batch;
+    size_t        slot_size;
+    unsigned long queue_size;
+    unsigned long ops;         // Items per producer, 0 for a timed run
+    unsigned long duration_ms; // Length of a timed run
+    bool          check, latency;
+    bool          generic;     // MPMC path even for one producer/consumer
+};
+
+// Queue item of S bytes.
+template<size_t S>
+struct Item {
+    char d_[S];
+};
+
+static inline void
+bench_usage(const char *prog)
+{
+    printf("Usage: %s [options...]\n"
+           "  -y, --policy <list>   persistence policies, comma-separated:\n"
+           "                        volatile, eadr, adr, adr-compact,\n"
+           "                        adr-group, msync, adr-tx or all\n"
+           "                        (default volatile)\n"
+           "  -p, --producers <n>   producer threads (default %d)\n"
+           "  -c, --consumers <n>   consumer threads (default %d)\n"
+           "  -s, --slot-size <n>   bytes per item: 64, 128, 256, 512, 1024,\n"
+           "                        2048 or 4096 (default %d)\n"
+           "  -q, --queue-size <n>  slots: 1024 or 32768 (default %d)\n"
+           "  -b, --batch <n>       items per push_n()/pop_n() (default %d)\n"
+           "  -n, --ops <n>         items per producer (default %d)\n"
+           "  -d, --duration <ms>   run for ms milliseconds instead of -n\n"
+           "  -g, --generic         use the MPMC path even with one producer\n"
+           "                        or consumer\n"
+           "  -k, --check           check every popped item\n"
+           "  -l, --latency         record push/pop latency histograms\n",
+           prog, NPRODUCERS, NCONSUMERS, SLOT_SIZE, QUEUE_SIZE, BATCH_SIZE,
+           QUEUE_SIZE * 32);
+}
+
+/*
+ * Parse the command line. Returns false and prints the usage on errors.
+ */
+static inline bool
+bench_parse(int argc, char **argv, BenchOpts &o)
+{
+    static const struct option opts[] = {
+        {"producers",  required_argument, NULL, 'p'},
+        {"consumers",  required_argument, NULL, 'c'},
+        {"slot-size",  required_argument, NULL, 's'},
+        {"queue-size", required_argument, NULL, 'q'},
+        {"batch",      required_argument, NULL, 'b'},
+        {"ops",        required_argument, NULL, 'n'},
+        {"duration",   required_argument, NULL, 'd'},
+        {"policy",     required_argument, NULL, 'y'},
+        {"generic",    no_argument,       NULL, 'g'},
+        {"check",      no_argument,       NULL, 'k'},
+        {"latency",    no_argument,       NULL, 'l'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    o.policies = "volatile";
+    o.policy = NULL;
+    o.producers = NPRODUCERS;
+    o.consumers = NCONSUMERS;
+    o.slot_size = SLOT_SIZE;
+    o.queue_size = QUEUE_SIZE;
+    o.batch = BATCH_SIZE;
+    o.ops = QUEUE_SIZE * 32;
+    o.duration_ms = 0;
+    o.check = o.latency = o.generic = false;
+
+    while ((c = getopt_long(argc, argv, "y:p:c:s:q:b:n:d:gklh", opts,
+                            NULL)) != -1) {
+        switch (c) {
+        case 'p':
+            o.producers = atol(optarg);
+            break;
+        case 'c':
+            o.consumers = atol(optarg);
+            break;
+        case 's':
+            o.slot_size = atol(optarg);
+            break;
+        case 'q':
+            o.queue_size = atol(optarg);
+            break;
+        case 'b':
+            o.batch = atol(optarg);
+            break;
+        case 'n':
+            o.ops = atol(optarg);
+            break;
+        case 'd':
+            o.duration_ms = atol(optarg);
+            o.ops = 0;
+            break;
+        case 'y':
+            o.policies = optarg;
+            break;
+        case 'g':
+            o.generic = true;
+            break;
+        case 'k':
+            o.check = true;
+            break;
+        case 'l':
+            o.latency = true;
+            break;
+        default:
+            bench_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (!o.producers || !o.consumers || !o.batch ||
+            (!o.ops && !o.duration_ms) || o.ops % o.batch ||
+            o.batch > o.queue_size) {
+        bench_usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+// Whether a run takes the single-producer or single-consumer path.
+static inline bool
+bench_sp(const BenchOpts &o)
+{
+    return o.producers == 1 && !o.generic;
+}
+
+static inline bool
+bench_sc(const BenchOpts &o)
+{
+    return o.consumers == 1 && !o.generic;
+}
+
+static inline const char *
+bench_path(const BenchOpts &o)
+{
+    static const char *names[] = {"mpmc", "mpsc", "spmc", "spsc"};
+    return names[bench_sp(o) * 2 + bench_sc(o)];
+}
+
+// Per-thread results, one cache line apart.
+struct BenchThr {
+    unsigned long ops ____cacheline_aligned;
+    double        secs;
+    unsigned long sum;    // Sum of the sequence numbers pushed or popped
+    unsigned long errors; // Corrupted items seen with --check
+};
+
+/*
+ * Stamp an item with its producer and sequence number at both ends, so
+ * a consumer can tell a torn or stale item from a good one.
+ */
+template<class T>
+static inline void
+bench_stamp(T *v, size_t id, unsigned long seq)
+{
+    unsigned long tag = (id << 48) ^ seq;
+    memcpy(v->d_, &tag, sizeof(tag));
+    memcpy(v->d_ + sizeof(v->d_) - sizeof(tag), &tag, sizeof(tag));
+}
+
+template<class T>
+static inline bool
+bench_verify(const T *v, unsigned long *seq)
+{
+    unsigned long head, tail;
+    memcpy(&head, v->d_, sizeof(head));
+    memcpy(&tail, v->d_ + sizeof(v->d_) - sizeof(tail), sizeof(tail));
+    *seq = head & ((1UL << 48) - 1);
+    return head == tail;
+}
+
+static inline void
+bench_print_thr(const char *key, const std::vector<BenchThr> &thr,
+                bool last)
+{
+    printf("  \"%s\": [", key);
+    for (size_t i = 0; i < thr.size(); ++i)
+        printf("%s{\"id\": %zu, \"ops\": %lu, \"ops_per_sec\": %.0f}",
+               i ? ", " : "", i, thr[i].ops,
+               thr[i].secs ? thr[i].ops / thr[i].secs : 0);
+    printf("]%s\n", last ? "" : ",");
+}
+
+/*
+ * Run producers and consumers on q and print the results. Consumers pop
+ * with try_pop_n() and count the items in a shared counter, so a timed
+ * run can end once the producers have stopped and the queue is drained.
+ */
+template<class Q, class T>
+void
+run_bench(Q &q, const BenchOpts &o)
+{
+    std::vector<std::thread> thr;
+    std::vector<BenchThr> p_res(o.producers), c_res(o.consumers);
+    std::vector<LatHist> p_lat(o.latency ? o.producers : 0);
+    std::vector<LatHist> c_lat(o.latency ? o.consumers : 0);
+    std::atomic<bool> stop(false);
+    std::atomic<unsigned long> drained(0);
+    // Items to be pushed, known in advance unless the run is timed.
+    std::atomic<unsigned long> limit(o.ops ? o.ops * o.producers : ULONG_MAX);
+
+    double t0 = get_timestamp();
+
+    for (size_t i = 0; i < o.producers; ++i)
+        thr.emplace_back([&, i] {
+        place_thread(PRODUCER, i, o.producers);
+        set_thr_id(i);
+        std::vector<T> v(o.batch);
+        BenchThr &r = p_res[i];
+        double start = get_timestamp();
+
+        while (o.ops ? r.ops < o.ops : !stop.load(std::memory_order_relaxed)) {
+            if (o.check)
+                for (size_t j = 0; j < o.batch; ++j) {
+                    bench_stamp(&v[j], i, r.ops + j);
+                    r.sum += r.ops + j;
+                }
+            u64 t = o.latency ? rdtsc() : 0;
+            q.push_n(v.data(), o.batch);
+            if (o.latency)
+                p_lat[i].record(rdtsc() - t);
+            r.ops += o.batch;
+        }
+        r.secs = (get_timestamp() - start) / 1000000;
+    });
+
+    for (size_t i = 0; i < o.consumers; ++i)
+        thr.emplace_back([&, i] {
+        place_thread(CONSUMER, i, o.producers);
+        set_thr_id(i);
+        std::vector<T> v(o.batch);
+        BenchThr &r = c_res[i];
+        double start = get_timestamp();
+
+        while (true) {
+            u64 t = o.latency ? rdtsc() : 0;
+            bool done = false;
+            while (!q.try_pop_n(v.data(), o.batch)) {
+                // Empty and every item that will be pushed is gone.
+                if (drained.load() >= limit.load()) {
+                    done = true;
+                    break;
+                }
+                _mm_pause();
+            }
+            if (done)
+                break;
+            drained.fetch_add(o.batch);
+            if (o.latency)
+                c_lat[i].record(rdtsc() - t);
+            if (o.check)
+                for (size_t j = 0; j < o.batch; ++j) {
+                    unsigned long seq;
+                    if (!bench_verify(&v[j], &seq))
+                        ++r.errors;
+                    r.sum += seq;
+                }
+            r.ops += o.batch;
+        }
+        r.secs = (get_timestamp() - start) / 1000000;
+    });
+
+    if (!o.ops) {
+        ::usleep(o.duration_ms * 1000);
+        stop.store(true);
+        for (size_t i = 0; i < o.producers; ++i)
+            thr[i].join();
+        unsigned long total = 0;
+        for (auto &r : p_res)
+            total += r.ops;
+        limit.store(total);
+    }
+    for (size_t i = o.ops ? 0 : o.producers; i < thr.size(); ++i)
+        thr[i].join();
+
+    double secs = (get_timestamp() - t0) / 1000000;
+    unsigned long pushed = 0, popped = 0, p_sum = 0, c_sum = 0, errors = 0;
+    for (auto &r : p_res) {
+        pushed += r.ops;
+        p_sum += r.sum;
+    }
+    for (auto &r : c_res) {
+        popped += r.ops;
+        c_sum += r.sum;
+        errors += r.errors;
+    }
+
+    printf("{\n");
+    printf("  \"policy\": \"%s\",\n", o.policy);
+    printf("  \"path\": \"%s\",\n", bench_path(o));
+    printf("  \"pmem\": %s,\n", q.is_pmem() ? "true" : "false");
+    printf("  \"producers\": %zu,\n", o.producers);
+    printf("  \"consumers\": %zu,\n", o.consumers);
+    printf("  \"slot_size\": %zu,\n", o.slot_size);
+    printf("  \"queue_size\": %lu,\n", o.queue_size);
+    printf("  \"batch\": %zu,\n", o.batch);
+    printf("  \"placement\": \"%s\",\n", placement_name());
+    printf("  \"seconds\": %.6f,\n", secs);
+    printf("  \"items\": %lu,\n", popped);
+    printf("  \"ops_per_sec\": %.0f,\n", popped / secs);
+    printf("  \"gb_per_sec\": %.3f,\n", popped * o.slot_size / secs / 1e9);
+    if (o.check)
+        printf("  \"check\": \"%s\",\n", pushed == popped && p_sum == c_sum &&
+               !errors ? "passed" : "failed");
+    if (o.latency) {
+        LatHist push, pop;
+        for (auto &h : p_lat)
+            push.merge(h);
+        for (auto &h : c_lat)
+            pop.merge(h);
+        printf("  \"latency_cycles\": {\"push\": ");
+        push.print_json(stdout);
+        printf(", \"pop\": ");
+        pop.print_json(stdout);
+        printf("},\n");
+    }
+    bench_print_thr("producer_threads", p_res, false);
+    bench_print_thr("consumer_threads", c_res, true);
+    printf("}\n");
+}
+
+/*
+ * Create an empty pool directory for a persistent run. Every run starts
+ * from scratch, as the geometry may differ from the previous one.
+ */
+static inline pool_dir_t *
+bench_pool_open(const BenchOpts &o)
+{
+    const char *path = PMEM_DAXFS_PATH "/bench";
+    size_t size = POOL_DATA_OFF + (4 << 20) +
+                  o.queue_size * roundup(o.slot_size, XPLINE_SIZE);
+
+    unlink(path);
+    return pool_dir_open(path, size);
+}
+
+/*
+ * Call B<Item<slot_size>, queue_size>::run(o) for the sizes compiled in.
+ * B is a small adapter that builds the queue.
+ * Every size pair is a separate instantiation of the queue, so keep the
+ * lists short; add a case to measure another size.
+ */
+template<template<class, unsigned long> class B, class T>
+bool
+bench_queue_size(const BenchOpts &o)
+{
+    switch (o.queue_size) {
+    case 1024:
+        B<T, 1024>::run(o);
+        return true;
+    case 32768:
+        B<T, 32768>::run(o);
+        return true;
+    }
+    return false;
+}
+
+template<template<class, unsigned long> class B>
+bool
+bench_dispatch(const BenchOpts &o)
+{
+    bool ok = false;
+
+    switch (o.slot_size) {
+    case 64:
+        ok = bench_queue_size<B, Item<64>>(o);
+        break;
+    case 128:
+        ok = bench_queue_size<B, Item<128>>(o);
+        break;
+    case 256:
+        ok = bench_queue_size<B, Item<256>>(o);
+        break;
+    case 512:
+        ok = bench_queue_size<B, Item<512>>(o);
+        break;
+    case 1024:
+        ok = bench_queue_size<B, Item<1024>>(o);
+        break;
+    case 2048:
+        ok = bench_queue_size<B, Item<2048>>(o);
+        break;
+    case 4096:
+        ok = bench_queue_size<B, Item<4096>>(o);
+        break;
+    }
+    if (!ok)
+        fprintf(stderr, "Slot size %zu or queue size %lu is not compiled "
+                "in\n", o.slot_size, o.queue_size);
+    return ok;
+}
+
+#endif /* Q_BENCH_H */
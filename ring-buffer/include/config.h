@@ -20,15 +20,91 @@
 
 #undef CHECK_DATA /* Disable data validation */
 
+#undef ZERO_COPY /* Test push()/pop() rather than reserve()/borrow() */
+
+#undef TRY_OPS /* Test blocking push()/pop() rather than try_push()/try_pop() */
+
+#ifndef PMEM_DAXFS_PATH
 #define PMEM_DAXFS_PATH "/mnt/pmem1"
+#endif
 
 #define QUEUE_SIZE	(32 * 1024) /* 32KB */
 
+#ifndef SLOT_SIZE
 #define SLOT_SIZE       4096 /* 4KB */
+#endif
 
+#ifndef NPRODUCERS
 #define NPRODUCERS      14
+#endif
 
+#ifndef NCONSUMERS
 #define NCONSUMERS      14
+#endif
+
+#ifndef BATCH_SIZE
+#define BATCH_SIZE      1 /* Items per push_n()/pop_n() call */
+#endif
+
+#define LAT_WARMUP      10000 /* Timed ops per thread left out of latency */
+
+#ifndef NO_XPLINE_SLOTS
+#define XPLINE_SLOTS /* Pad ring slots and records to whole XPLines */
+#endif
+
+#define NT_STORE_THRESHOLD 256 /* Min copy size for non-temporal stores */
+
+#define SPIN_COUNT      1024 /* Polls before a waiting thread yields */
+
+#define YIELD_COUNT     64 /* Yields before a waiting thread sleeps */
+
+#define OVERSUB_CPUS    0 /* Squeeze all test threads on so many CPUs */
+
+#ifndef PIN_POLICY
+#define PIN_POLICY      PIN_NONE /* Or PIN_COMPACT, PIN_SCATTER, PIN_SPLIT */
+#endif
+
+#ifndef PIN_SMT
+#define PIN_SMT         1 /* Pin threads to SMT siblings too */
+#endif
+
+#ifndef ARRAY_NODE
+#define ARRAY_NODE      -1 /* First-touch node of volatile slots, -1 = any */
+#endif
+
+#define RECOVERY_THREADS 8 /* Threads moving slots during recovery */
+
+#define RECOVERY_SLICE  (1 << 20) /* Min bytes moved per recovery thread */
+
+#define GROUP_COMMIT_US 50 /* Persister period of group-commit queues */
+
+#ifndef MSYNC_COMMIT_US
+#define MSYNC_COMMIT_US 1000 /* Persister period if it has to msync() */
+#endif
+
+#define POOL_SIZE       (16UL << 30) /* Size of a new pool directory file */
+
+#define POOL_QUEUES     8 /* Queues opened by the pool test */
+
+/* Append-only log */
+#define LOG_GROUPS      8 /* Consumer groups per log */
+
+#define LOG_NAME_LEN    48 /* Longest group name, with the NUL */
+
+/* Segmented unbounded queue */
+#define SEGMENT_SIZE    (QUEUE_SIZE / 8) /* Slots per ring segment */
+
+/* NUMA-sharded queue: one DAX mount per node */
+#define NUMA_NODES      2
+
+#define PMEM_NODE_PATHS {"/mnt/pmem0", "/mnt/pmem1"}
+
+/* Variable-length record queue */
+#define RING_CAPACITY   (QUEUE_SIZE * SLOT_SIZE) /* Default, in bytes */
+
+#define MIN_RECORD_SIZE 40
+
+#define MAX_RECORD_SIZE SLOT_SIZE
 
 /*
  * ----------------------------------------
@@ -39,6 +115,20 @@
 
 #define QUEUE_MAGIC     0x4E4F6327
 
+#define COMPACT_QUEUE_MAGIC 0x4E4F6329
+
+#define GROUP_QUEUE_MAGIC 0x4E4F632A
+
+#define TX_QUEUE_MAGIC  0x4E4F632B
+
+#define SEG_QUEUE_MAGIC 0x4E4F632C
+
+#define LOSSY_QUEUE_MAGIC 0x4E4F632D
+
+#define XPLINE_SIZE     256 /* Optane media access granularity */
+
+#define VAR_QUEUE_MAGIC 0x4E4F6328
+
 #ifndef __x86_64__
 #warning "The program is developed for x86-64 architecture only."
 #endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_CRASH_H
+#define Q_CRASH_H
+
+/*
+ * ------------------------------------------------------------------------
+ * Crash injection.
+ *
+ * CRASH_POINT(site) marks a spot between two persistence steps of push
+ * or pop. Built with CRASH_INJECT (make CRASH=y), the process kills
+ * itself with SIGKILL when it passes the CRASH_AT'th crash point, counted
+ * over all threads. With CRASH_SITE set only points of that site count.
+ * Without CRASH_INJECT the points compile to nothing.
+ * ------------------------------------------------------------------------
+ */
+#ifdef CRASH_INJECT
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+class CrashPoints {
+public:
+    static CrashPoints &
+    get()
+    {
+        static CrashPoints cp;
+        return cp;
+    }
+
+    void
+    pass(const char *site)
+    {
+        if (left_.load(std::memory_order_relaxed) <= 0)
+            return;
+        if (site_ && *site_ && strcmp(site, site_))
+            return;
+        if (left_.fetch_sub(1) == 1)
+            ::raise(SIGKILL);
+    }
+
+private:
+    CrashPoints()
+        : left_(0),
+          site_(getenv("CRASH_SITE"))
+    {
+        const char *at = getenv("CRASH_AT");
+        if (at)
+            left_ = atol(at);
+    }
+
+    std::atomic<long> left_; // Crash points to pass before the kill
+    const char *site_;
+};
+
+#define CRASH_POINT(site)   CrashPoints::get().pass(site)
+
+#else
+
+#define CRASH_POINT(site)   do { } while (0)
+
+#endif /* CRASH_INJECT */
+
+#endif /* Q_CRASH_H */
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_HISTOGRAM_H
+#define Q_HISTOGRAM_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "config.h"
+#include "timer.h"
+#include "util.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Latency histograms.
+ *
+ * Every thread records into its own log-linear (HDR-style) histogram, so
+ * recording is a few instructions and never shared. Values below
+ * 2^LAT_SUB_BITS cycles are exact, larger ones fall into one of
+ * 2^LAT_SUB_BITS buckets per power of two, i.e. within 1/2^LAT_SUB_BITS
+ * of the real value. A histogram takes 15KB whatever the run length.
+ * The first LAT_WARMUP samples of every thread are dropped.
+ * ------------------------------------------------------------------------
+ */
+#define LAT_SUB_BITS    5
+#define LAT_SUB         (1UL << LAT_SUB_BITS)
+#define LAT_BUCKETS     ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+class LatHist {
+public:
+    LatHist()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+
+    void
+    record(u64 v)
+    {
+        if (UNLIKELY(warmup_ < LAT_WARMUP)) {
+            ++warmup_;
+            return;
+        }
+        ++cnt_[bucket(v)];
+        ++n_;
+        sum_ += v;
+        max_ = std::max(max_, v);
+    }
+
+    void
+    merge(const LatHist &h)
+    {
+        for (unsigned long i = 0; i < LAT_BUCKETS; ++i)
+            cnt_[i] += h.cnt_[i];
+        n_ += h.n_;
+        sum_ += h.sum_;
+        max_ = std::max(max_, h.max_);
+    }
+
+    // Print one summary line, in cycles, prefixed by "LAT name".
+    void
+    print(const char *name) const
+    {
+        if (!n_)
+            return;
+        printf("LAT %s n %llu avg %.1f p50 %llu p99 %llu p99.9 %llu "
+               "p99.99 %llu max %llu\n", name, (unsigned long long)n_,
+               avg(), pct(50), pct(99), pct(99.9), pct(99.99),
+               (unsigned long long)max_);
+    }
+
+    // Print the same summary as a JSON object.
+    void
+    print_json(FILE *f) const
+    {
+        fprintf(f, "{\"n\": %llu, \"avg\": %.1f, \"p50\": %llu, "
+                "\"p99\": %llu, \"p99.9\": %llu, \"p99.99\": %llu, "
+                "\"max\": %llu}", (unsigned long long)n_, avg(), pct(50),
+                pct(99), pct(99.9), pct(99.99), (unsigned long long)max_);
+    }
+
+    double
+    avg() const
+    {
+        return n_ ? (double)sum_ / n_ : 0;
+    }
+
+    // Value below which p percent of the samples fall.
+    unsigned long long
+    pct(double p) const
+    {
+        u64 rank = (u64)(p / 100 * n_), seen = 0;
+        for (unsigned long i = 0; i < LAT_BUCKETS; ++i) {
+            seen += cnt_[i];
+            if (seen > rank)
+                return std::min(value(i), (unsigned long long)max_);
+        }
+        return max_;
+    }
+
+private:
+    static unsigned long
+    bucket(u64 v)
+    {
+        if (v < LAT_SUB)
+            return v;
+        unsigned e = 63 - __builtin_clzll(v);
+        return (e - LAT_SUB_BITS + 1) * LAT_SUB +
+               ((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+    }
+
+    // Middle of the values that map to bucket i.
+    static unsigned long long
+    value(unsigned long i)
+    {
+        if (i < LAT_SUB)
+            return i;
+        unsigned long b = i / LAT_SUB, m = i % LAT_SUB;
+        return ((LAT_SUB + m) << (b - 1)) + (1ULL << (b - 1)) / 2;
+    }
+
+    u64 cnt_[LAT_BUCKETS];
+    u64 n_, sum_, max_;
+    unsigned long warmup_;
+};
+
+enum LatKind {
+    LAT_PUSH,
+    LAT_POP,
+    LAT_KINDS
+};
+
+// All per-thread histograms of one process.
+struct LatRegistry {
+    std::mutex lock;
+    std::vector<LatHist *> hist[LAT_KINDS];
+};
+
+static LatRegistry lat_registry;
+
+// Record a latency of cycles for the calling thread.
+static inline void
+lat_record(LatKind kind, u64 cycles)
+{
+    static thread_local LatHist *h[LAT_KINDS];
+
+    if (UNLIKELY(!h[kind])) {
+        h[kind] = new LatHist;
+        std::lock_guard<std::mutex> l(lat_registry.lock);
+        lat_registry.hist[kind].push_back(h[kind]);
+    }
+    h[kind]->record(cycles);
+}
+
+/*
+ * Merge the histograms of all threads, print them and start over.
+ * Call once the recording threads are done.
+ */
+static inline void
+lat_report()
+{
+    static const char *names[LAT_KINDS] = {"push", "pop"};
+    std::lock_guard<std::mutex> l(lat_registry.lock);
+
+    for (int k = 0; k < LAT_KINDS; ++k) {
+        LatHist all;
+        for (auto h : lat_registry.hist[k]) {
+            all.merge(*h);
+            *h = LatHist();
+        }
+        all.print(names[k]);
+    }
+}
+
+#endif /* Q_HISTOGRAM_H */
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_LF_LOG_H
+#define Q_LF_LOG_H
+
+#include <string.h>
+
+#include <algorithm>
+#include <cassert>
+#include <mutex>
+
+#include "config.h"
+#include "util.h"
+#include "lf_queue.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Durable append-only log with consumer groups.
+ *
+ * Producers append to one persistent ring as they push to a queue, so an
+ * item is written to PMEM once however many services read it. Reading
+ * does not take items away: every named consumer group has its own read
+ * offset in PMEM and sees every item appended after it joined. A group
+ * is read by one thread at a time; fan out over several groups.
+ *
+ * The ring is a single-consumer LockFreeQueue whose tail_ is the offset
+ * of the slowest group. Producers wait for it exactly as for the tail of
+ * a queue, so a slot is reclaimed once every group has passed it. Until
+ * then a group may seek back to any offset not below tail_ and replay.
+ * ------------------------------------------------------------------------
+ */
+template<class T,
+         class P = Adr,
+         decltype(thr_id) ThrId = thr_id,
+         unsigned long Q_SIZE = QUEUE_SIZE,
+         bool SP = NPRODUCERS == 1>
+class LockFreeLog
+{
+private:
+    typedef LockFreeQueue<T, P, ThrId, Q_SIZE, SP, true> Ring;
+    typedef typename Ring::LogGroup Group;
+    typedef typename Ring::TxScope TxScope;
+
+    Group &
+    group(int g) const
+    {
+        assert(g >= 0 && g < LOG_GROUPS && ring_.qi_->groups_[g].name[0]);
+        return ring_.qi_->groups_[g];
+    }
+
+    void
+    set_offset(Group &grp, unsigned long off)
+    {
+        TxScope tx(ring_.pop_);
+        P::log(&grp.offset, sizeof(grp.offset));
+        grp.offset = off;
+        P::persist(&grp.offset, sizeof(grp.offset));
+    }
+
+    /*
+     * Move tail_ up to the slowest group, or to everything published if
+     * there is no group. Called with lock_ held.
+     */
+    void
+    reclaim()
+    {
+        auto min = ring_.qi_->last_head_;
+        for (auto &grp : ring_.qi_->groups_)
+            if (grp.name[0])
+                min = std::min(min, grp.offset);
+
+        if (min > ring_.qi_->tail_) {
+            ring_.qi_->tail_ = min;
+            ring_.qi_->last_tail_ = min;
+            ring_.tail_ev_->notify();
+        }
+    }
+
+    /*
+     * Fit the groups to the recovered ring. Items not published any more
+     * are dropped from the offsets; tail_ is not persisted by the log, so
+     * it is derived from them.
+     */
+    void
+    recover()
+    {
+        auto head = ring_.qi_->last_head_;
+        for (auto &grp : ring_.qi_->groups_)
+            if (grp.name[0] && grp.offset > head)
+                set_offset(grp, head);
+
+        auto min = head;
+        for (auto &grp : ring_.qi_->groups_)
+            if (grp.name[0])
+                min = std::min(min, grp.offset);
+        ring_.qi_->tail_ = ring_.qi_->last_tail_ = min;
+    }
+
+public:
+    // Open or create the log in the file "queue" under PMEM_DAXFS_PATH.
+    explicit LockFreeLog(size_t n_producers)
+        : ring_(n_producers, 1)
+    {
+        recover();
+    }
+
+    // Open or create the log called name in a pool directory.
+    LockFreeLog(pool_dir_t *pool, const char *name, size_t n_producers)
+        : ring_(pool, name, n_producers, 1)
+    {
+        recover();
+    }
+
+    // @return the sequence number to pass to wait_durable().
+    unsigned long
+    append(T *ptr)
+    {
+        return ring_.push(ptr);
+    }
+
+    unsigned long
+    append_n(T *ptr, size_t n)
+    {
+        return ring_.push_n(ptr, n);
+    }
+
+    void
+    wait_durable(unsigned long seq)
+    {
+        ring_.wait_durable(seq);
+    }
+
+    /*
+     * Open the consumer group called name, creating it at the oldest
+     * retained item. Producers stall while a group lags a whole ring
+     * behind, so drop() groups that are gone for good.
+     * @return the group id, or -1 if all LOG_GROUPS are taken.
+     */
+    int
+    join(const char *name)
+    {
+        assert(name[0] && strlen(name) < LOG_NAME_LEN);
+        std::lock_guard<std::mutex> l(lock_);
+
+        int free = -1;
+        for (int g = 0; g < LOG_GROUPS; ++g) {
+            auto &grp = ring_.qi_->groups_[g];
+            if (!strncmp(grp.name, name, LOG_NAME_LEN))
+                return g;
+            if (free < 0 && !grp.name[0])
+                free = g;
+        }
+        if (free < 0)
+            return -1;
+
+        // The name makes the group visible, so it goes last.
+        auto &grp = ring_.qi_->groups_[free];
+        set_offset(grp, ring_.qi_->tail_);
+        TxScope tx(ring_.pop_);
+        P::log(grp.name, sizeof(grp.name));
+        strncpy(grp.name, name, LOG_NAME_LEN);
+        P::persist(grp.name, sizeof(grp.name));
+        return free;
+    }
+
+    // Delete group g, releasing the items it has not read.
+    void
+    drop(int g)
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        auto &grp = group(g);
+        {
+            TxScope tx(ring_.pop_);
+            P::log(grp.name, sizeof(grp.name));
+            grp.name[0] = 0;
+            P::persist(grp.name, sizeof(grp.name));
+        }
+        reclaim();
+    }
+
+    // Read the next n items of group g, waiting for them if necessary.
+    void
+    read_n(int g, T *ptr, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        auto &grp = group(g);
+        auto off = grp.offset;
+
+        if (UNLIKELY(off + n > ring_.qi_->last_head_)) {
+            ring_.head_ev_->wait_until([&] {
+                // Update the last_head_.
+                ring_.update_last_head();
+                return off + n <= ring_.qi_->last_head_;
+            });
+        }
+        ring_.copy_from_ring(off, ptr, n);
+        advance(grp, off, off + n);
+    }
+
+    void
+    read(int g, T *ptr)
+    {
+        read_n(g, ptr, 1);
+    }
+
+    /*
+     * Read the next n items of group g if all of them are there.
+     * @return false, without reading anything, otherwise.
+     */
+    bool
+    try_read_n(int g, T *ptr, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        auto &grp = group(g);
+        auto off = grp.offset;
+
+        if (UNLIKELY(off + n > ring_.qi_->last_head_)) {
+            ring_.update_last_head();
+            if (off + n > ring_.qi_->last_head_)
+                return false;
+        }
+        ring_.copy_from_ring(off, ptr, n);
+        advance(grp, off, off + n);
+        return true;
+    }
+
+    bool
+    try_read(int g, T *ptr)
+    {
+        return try_read_n(g, ptr, 1);
+    }
+
+    /*
+     * Move group g to offset off to replay or skip items.
+     * @return false if off is reclaimed already or not appended yet.
+     */
+    bool
+    seek(int g, unsigned long off)
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        auto &grp = group(g);
+        if (off < ring_.qi_->tail_ || off > ring_.qi_->last_head_)
+            return false;
+
+        auto from = grp.offset;
+        set_offset(grp, off);
+        if (from == ring_.qi_->tail_)
+            reclaim();
+        return true;
+    }
+
+    // Next item group g reads.
+    unsigned long
+    offset(int g) const
+    {
+        return group(g).offset;
+    }
+
+    // Oldest retained item.
+    unsigned long
+    begin() const
+    {
+        return ring_.qi_->tail_;
+    }
+
+    // Next item to be published.
+    unsigned long
+    end() const
+    {
+        return ring_.qi_->last_head_;
+    }
+
+private:
+    /*
+     * Persist the new offset of a group that read [from, to). Only the
+     * slowest group holds producers back, so the others skip reclaim().
+     */
+    void
+    advance(Group &grp, unsigned long from, unsigned long to)
+    {
+        CMB();
+        set_offset(grp, to);
+        if (from == ring_.qi_->tail_) {
+            std::lock_guard<std::mutex> l(lock_);
+            reclaim();
+        }
+    }
+
+    Ring          ring_;
+    // Serializes joins, drops, seeks and reclaim().
+    std::mutex    lock_;
+};
+
+#endif /* Q_LF_LOG_H */
@@ -0,0 +1,1735 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+/**
+ * Copyright (C) 2012-2013 Alexander Krizhanovsky (ak@tempesta-tech.com).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef Q_LF_QUEUE_H
+#define Q_LF_QUEUE_H
+
+#include <sys/file.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include <libpmem.h>
+#include <libpmemobj.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "config.h"
+#include "util.h"
+#include "timer.h"
+#include "wait.h"
+#include "recovery.h"
+#include "crash.h"
+#include "persist.h"
+#include "pool_dir.h"
+#include "placement.h"
+#include "histogram.h"
+#include "test_common.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Lock-free N-producers M-consumers ring-buffer queue.
+ * ABA problem safe.
+ *
+ * This implementation is bit complicated, so possibly it makes sense to use
+ * classic list-based queues. See:
+ * 1. D.Fober, Y.Orlarey, S.Letz, "Lock-Free Techniques for Concurrent
+ *    Access to Shared Ojects"
+ * 2. M.M.Michael, M.L.Scott, "Simple, Fast and Practical Non-Blocking and
+ *    Blocking Concurrent Queue Algorithms"
+ * 3. E.Ladan-Mozes, N.Shavit, "An Optimistic Approach to Lock-Free FIFO Queues"
+ *
+ * See also implementation of N-producers M-consumers FIFO and
+ * 1-producer 1-consumer ring-buffer from Tim Blechmann:
+ *	http://tim.klingt.org/boost_lockfree/
+ *	git://tim.klingt.org/boost_lockfree.git
+ *
+ * See See Intel 64 and IA-32 Architectures Software Developer's Manual,
+ * Volume 3, Chapter 8.2 Memory Ordering for x86 memory ordering guarantees.
+ *
+ * P is the persistence policy, see persist.h.
+ *
+ * SP and SC select the single-producer and single-consumer paths. The
+ * only producer owns head_: it takes slots with a plain load and, once
+ * they are written and durable, publishes them with a plain store to
+ * head_ and last_head_. No fetch-and-add, no ThrPos and no scan of the
+ * producers. A single consumer does the same with tail_. The persistent
+ * record of that side is head_ or tail_ alone, so recovery has nothing
+ * to move for it.
+ *
+ * Processes may share a queue by opening it by name, see join(). Each
+ * ThrPos slot then records the pids of the processes owning its producer
+ * and consumer, so the survivors can reclaim what a dead one left.
+ * ------------------------------------------------------------------------
+ */
+template<class T,
+         class P = Adr,
+         decltype(thr_id) ThrId = thr_id,
+         unsigned long Q_SIZE = QUEUE_SIZE,
+         bool SP = NPRODUCERS == 1,
+         bool SC = NCONSUMERS == 1>
+class LockFreeQueue
+{
+private:
+    static const unsigned long Q_MASK = Q_SIZE - 1;
+    static const bool COMPACT = P::COMPACT;
+    static const bool GROUP = P::GROUP;
+
+    /*
+     * A ring slot. With XPLINE_SLOTS each slot starts at an XPLine and
+     * is padded to whole XPLines, so writing one slot never does a
+     * read-modify-write of a media line shared with another slot.
+     */
+#ifdef XPLINE_SLOTS
+    struct alignas(XPLINE_SIZE) Slot {
+        T item;
+    };
+#else
+    struct Slot {
+        T item;
+    };
+#endif
+    // The layout of the positions differs with SP and SC.
+    static const uint64_t MAGIC = P::MAGIC ^ (SP << 8) ^ (SC << 9);
+
+    struct WideThrPos {
+        unsigned long head ____cacheline_aligned;
+        // slots reserved at head, 0 until known (same cache line)
+        unsigned long n_head;
+        unsigned long tail ____cacheline_aligned;
+        // oldest position not acked, see pop_pending() (same cache line)
+        unsigned long unacked;
+        // last position returned by pop_pending(), not persisted
+        unsigned long pending;
+        unsigned long pos_pop ____cacheline_aligned;
+        // number of items popped at pos_pop (same cache line)
+        unsigned long n_pop;
+        unsigned long pos_push ____cacheline_aligned;
+        // number of items pushed at pos_push (same cache line)
+        unsigned long n_push;
+        // pids of the producer and consumer processes, see join()
+        unsigned long owner[2] ____cacheline_aligned;
+    };
+
+    /*
+     * All fields of one role share a cache line, so a push or a pop
+     * persists its position twice: once when it takes it and once
+     * when it is done. Stores to one line become persistent in program
+     * order, so a persisted head == ULONG_MAX implies a persisted
+     * pos_push and n_push. qi_->head_ and qi_->tail_ are not flushed,
+     * recover() derives them from the completed positions instead.
+     */
+    struct CompactThrPos {
+        // producer's line
+        unsigned long head ____cacheline_aligned;
+        unsigned long pos_push;
+        unsigned long n_push;
+        unsigned long n_head;
+        // consumer's line
+        unsigned long tail ____cacheline_aligned;
+        unsigned long pos_pop;
+        unsigned long n_pop;
+        unsigned long unacked;
+        unsigned long pending;
+        // owners' line
+        unsigned long owner[2] ____cacheline_aligned;
+    };
+
+    typedef typename std::conditional<COMPACT, CompactThrPos,
+            WideThrPos>::type ThrPos;
+
+    // Construct file path to use for PMEM pool.
+    void
+    pmem_path(std::string &path) const
+    {
+        // Create PMEM file path.
+        path = PMEM_DAXFS_PATH;
+        path += "/";
+        path += name_;
+    }
+
+    // Calculate required PMEM pool size for queue.
+    size_t
+    pmem_size() const
+    {
+        auto pagesize = getpagesize();
+        auto n = std::max(n_consumers_, n_producers_);
+        return roundup(sizeof(ThrPos) * n, pagesize) +
+               roundup(Q_SIZE * sizeof(Slot), pagesize) +
+               roundup(sizeof(QInfo), pagesize) +
+               pagesize;
+    }
+
+    // Allocate PMEM pool.
+    void *
+    pmempool_alloc(std::string &path, size_t size)
+    {
+        int is_pmem;
+        // Create pmem file and memory map it.
+        void *ptr = pmem_map_file(path.c_str(), size,
+                                  PMEM_FILE_CREATE, 0666,
+                                  NULL, &is_pmem);
+        is_pmem_ = is_pmem;
+        return ptr;
+    }
+
+    // Group commit writes back through the page cache.
+    bool
+    use_msync() const
+    {
+        return P::MSYNC || !is_pmem_;
+    }
+
+    // pmem_persist(), or msync() if the file is not PMEM.
+    void
+    persist_range(const void *addr, size_t len) const
+    {
+        if (use_msync())
+            pmem_msync(addr, len);
+        else
+            pmem_persist(addr, len);
+    }
+
+    // Compute last head.
+    unsigned long
+    find_last_head() const
+    {
+        auto min = qi_->head_;
+        if (SP)
+            return min;
+
+        // Find the last head.
+        for (size_t i = 0; i < n_producers_; ++i) {
+            auto tmp_t = thr_p_[i].head;
+
+            // Force compiler to use tmp_h exactly once.
+            CMB();
+
+            if (tmp_t < min)
+                min = tmp_t;
+        }
+        return min;
+    }
+
+    // Compute last tail, which does not pass items still to be acked.
+    unsigned long
+    find_last_tail() const
+    {
+        auto min = qi_->tail_;
+
+        // Find the last tail.
+        for (size_t i = 0; i < n_consumers_; ++i) {
+            auto tmp_t = SC ? ULONG_MAX : thr_p_[i].tail;
+            auto tmp_a = thr_p_[i].unacked;
+
+            // Force compiler to use tmp_h exactly once.
+            CMB();
+
+            if (tmp_t < min)
+                min = tmp_t;
+            if (tmp_a < min)
+                min = tmp_a;
+        }
+        return min;
+    }
+
+    /*
+     * Raise *last to v unless it is higher already. Processes sharing
+     * the queue do not share the Combiner, so a plain store could move
+     * it back.
+     */
+    static bool
+    raise_to(unsigned long *last, unsigned long v)
+    {
+        auto cur = *last;
+        while (v > cur) {
+            if (__sync_bool_compare_and_swap(last, cur, v))
+                return true;
+            cur = *last;
+        }
+        return false;
+    }
+
+    /*
+     * Advance last_head_ unless another thread is doing it already.
+     * A stale last_head_ is still safe: the lowest head never goes
+     * back, so only a higher value is published.
+     */
+    void
+    update_last_head()
+    {
+        // A single producer advances last_head_ itself.
+        if (SP)
+            return;
+        head_scan_.try_run([&] {
+            // Consumers sleeping meanwhile missed the update.
+            if (raise_to(&qi_->last_head_, find_last_head()))
+                head_ev_->notify();
+        });
+    }
+
+    // Advance last_tail_, see update_last_head().
+    void
+    update_last_tail()
+    {
+        if (SC)
+            return;
+        tail_scan_.try_run([&] {
+            if (raise_to(&qi_->last_tail_, find_last_tail()))
+                tail_ev_->notify();
+        });
+    }
+
+    /*
+     * Lowest position producers must not overwrite. With group commit a
+     * slot is only reused once its pop is durable, so the slots between
+     * the durable tail and head always hold their items.
+     */
+    unsigned long
+    reuse_limit() const
+    {
+        return GROUP ? qi_->durable_tail_ : qi_->last_tail_;
+    }
+
+    /*
+     * Write back the slots of positions [from, to). Through the page
+     * cache they are one or two runs of dirty pages, each synced at once.
+     */
+    void
+    flush_slots(unsigned long from, unsigned long to) const
+    {
+        for (auto pos = from; pos < to;) {
+            auto idx = pos & Q_MASK;
+            auto n = std::min(to - pos, Q_SIZE - idx);
+            if (use_msync()) {
+                pmem_msync(&ptr_array_[idx], n * sizeof(Slot));
+            } else if (sizeof(Slot) != sizeof(T)) {
+                for (unsigned long i = 0; i < n; ++i)
+                    pmem_flush(&ptr_array_[idx + i].item, sizeof(T));
+            } else {
+                pmem_flush(&ptr_array_[idx], n * sizeof(Slot));
+            }
+            pos += n;
+        }
+    }
+
+    /*
+     * Make everything pushed and popped so far durable: write back the
+     * new slots with a single drain, then persist both watermarks.
+     */
+    void
+    group_commit()
+    {
+        // Read the tail first, no pop passes a head taken later.
+        auto t = find_last_tail();
+        auto h = find_last_head();
+        if (h == qi_->durable_head_ && t == qi_->durable_tail_)
+            return;
+
+        flush_slots(qi_->durable_head_, h);
+        // Log offsets read after t are not below it.
+        if (use_msync()) {
+            pmem_msync(qi_->groups_, sizeof(qi_->groups_));
+        } else {
+            pmem_flush(qi_->groups_, sizeof(qi_->groups_));
+            pmem_drain();
+        }
+        qi_->durable_head_ = h;
+        qi_->durable_tail_ = t;
+        persist_range(&qi_->durable_head_, 2 * sizeof(unsigned long));
+
+        durable_ev_.notify();
+        // Producers may wait for the durable tail.
+        tail_ev_->notify();
+    }
+
+    /*
+     * Persister thread, commits every GROUP_COMMIT_US, or MSYNC_COMMIT_US
+     * through the page cache, until stopped.
+     */
+    void
+    persist_loop()
+    {
+        auto us = use_msync() ? MSYNC_COMMIT_US : GROUP_COMMIT_US;
+        while (!stop_.load()) {
+            ::usleep(us);
+            group_commit();
+        }
+        group_commit();
+    }
+
+    // Copy n items to the ring starting at position pos.
+    void
+    copy_to_ring(unsigned long pos, const T *ptr, size_t n)
+    {
+        auto idx = pos & Q_MASK;
+        auto n1 = std::min(n, (size_t)(Q_SIZE - idx));
+
+        if (sizeof(Slot) != sizeof(T)) {
+            // Padded slots are not contiguous.
+            for (size_t i = 0; i < n; ++i)
+                P::copy(&ptr_array_[(pos + i) & Q_MASK].item,
+                        ptr + i, sizeof(T));
+            return;
+        }
+        P::copy(&ptr_array_[idx], ptr, n1 * sizeof(T));
+        if (UNLIKELY(n1 < n))
+            P::copy(&ptr_array_[0], ptr + n1, (n - n1) * sizeof(T));
+    }
+
+    // Copy n items from the ring starting at position pos.
+    void
+    copy_from_ring(unsigned long pos, T *ptr, size_t n) const
+    {
+        auto idx = pos & Q_MASK;
+        auto n1 = std::min(n, (size_t)(Q_SIZE - idx));
+
+        if (sizeof(Slot) != sizeof(T)) {
+            for (size_t i = 0; i < n; ++i)
+                memcpy(ptr + i, &ptr_array_[(pos + i) & Q_MASK].item,
+                       sizeof(T));
+            return;
+        }
+        memcpy(ptr, &ptr_array_[idx], n1 * sizeof(T));
+        if (UNLIKELY(n1 < n))
+            memcpy(ptr + n1, &ptr_array_[0], (n - n1) * sizeof(T));
+    }
+
+    // Reserve n slots to push to, starting at tp.head.
+    void
+    reserve_head(ThrPos &tp, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        // Request next place to push.
+        if (SP) {
+            // Nobody else moves head_, tp.head is just a scratch copy.
+            tp.head = qi_->head_;
+        } else {
+            reserve_head_mp(tp, n);
+        }
+
+        /*
+         * We do not know when a consumer uses the pop()'ed pointer,
+         * se we can not overwrite it and have to wait the lowest tail.
+         * All n reserved slots must be free.
+         */
+        if (UNLIKELY(tp.head + n > reuse_limit() + Q_SIZE)) {
+            tail_ev_->wait_until([&] {
+                // Update the last_tail_.
+                update_last_tail();
+                return tp.head + n <= reuse_limit() + Q_SIZE;
+            });
+        }
+    }
+
+    // Shift head_ by n for one of several producers.
+    void
+    reserve_head_mp(ThrPos &tp, size_t n)
+    {
+        /*
+         * Second assignemnt is atomic only for head shift, so there is
+         * a time window in which thr_p_[tid].head = ULONG_MAX, and
+         * head could be shifted significantly by other threads,
+         * so pop() will set last_head_ to head.
+         * After that thr_p_[tid].head is setted to old head value
+         * (which is stored in local CPU register) and written by @ptr.
+         *
+         * First assignment guaranties that pop() sees values for
+         * head and thr_p_[tid].head not greater that they will be
+         * after the second assignment with head shift.
+         *
+         * Loads and stores are not reordered with locked instructions,
+         * se we don't need a memory barrier here.
+         */
+        P::log(&tp.head, sizeof(tp.head));
+        // tp.head is a lower bound rather than our slots until n_head is set.
+        tp.n_head = 0;
+        tp.head = qi_->head_;
+        P::persist(&tp.head, sizeof(tp.head));
+        CRASH_POINT("reserve_head");
+        if (COMPACT) {
+            /*
+             * The persisted head is not greater than the one we take,
+             * which is enough for recovery to treat the slots as
+             * in flight.
+             */
+            tp.head = __sync_fetch_and_add(&qi_->head_, n);
+            tp.n_head = n;
+        } else {
+            P::log(&qi_->head_, sizeof(qi_->head_));
+            tp.head = __sync_fetch_and_add(&qi_->head_, n);
+            tp.n_head = n;
+            P::flush(&qi_->head_, sizeof(qi_->head_));
+            P::flush(&tp.head, sizeof(tp.head));
+            CRASH_POINT("reserve_head_flush");
+            P::drain();
+        }
+    }
+
+    // Publish n written slots starting at tp.head to consumers.
+    void
+    publish_head(ThrPos &tp, size_t n)
+    {
+        /*
+         * n_push shares the cache line with pos_push and is written
+         * first, so a persisted pos_push always has a valid count.
+         * The slots were flushed by the caller; the drain below
+         * covers both them and pos_push.
+         */
+        if (SP) {
+            // The slots must be durable before head_ covers them.
+            P::drain();
+            CRASH_POINT("publish_head");
+            P::log(&qi_->head_, sizeof(qi_->head_));
+            CMB();
+            qi_->head_ = tp.head + n;
+            P::persist(&qi_->head_, sizeof(qi_->head_));
+
+            // Allow consumers to eat the items.
+            qi_->last_head_ = qi_->head_;
+            head_ev_->notify();
+            return;
+        }
+        if (COMPACT) {
+            // The slots must be durable before the line says so.
+            P::drain();
+            CRASH_POINT("publish_head");
+            tp.n_push = n;
+            tp.pos_push = tp.head;
+            CMB();
+
+            // Allow consumers to eat the items.
+            tp.head = ULONG_MAX;
+            P::persist(&tp.head, sizeof(tp.head) + sizeof(tp.pos_push) +
+                       sizeof(tp.n_push));
+            head_ev_->notify();
+            return;
+        }
+
+        P::log(&tp.pos_push, sizeof(tp.pos_push) + sizeof(tp.n_push));
+        tp.n_push = n;
+        tp.pos_push = tp.head;
+        CMB();
+        P::flush(&tp.pos_push, sizeof(tp.pos_push) + sizeof(tp.n_push));
+        CRASH_POINT("publish_head_flush");
+        P::drain();
+        CRASH_POINT("publish_head");
+
+        // Allow consumers to eat the items.
+        tp.head = ULONG_MAX;
+        P::persist(&tp.head, sizeof(tp.head));
+        head_ev_->notify();
+    }
+
+    // Reserve n slots to pop from, starting at tp.tail.
+    void
+    reserve_tail(ThrPos &tp, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        // Request next place from which to pop.
+        if (SC) {
+            tp.tail = qi_->tail_;
+        } else {
+            reserve_tail_mc(tp, n);
+        }
+
+        /*
+         * tid'th place in ptr_array_ is reserved by the thread -
+         * this place shall never be rewritten by push() and
+         * last_tail_ at push() is a guarantee.
+         * last_head_ guaraties that no any consumer eats the item
+         * before producer reserved the position writes to it.
+         * All n reserved slots must be written.
+         */
+        if (UNLIKELY(tp.tail + n > qi_->last_head_)) {
+            head_ev_->wait_until([&] {
+                // Update the last_head_.
+                update_last_head();
+                return tp.tail + n <= qi_->last_head_;
+            });
+        }
+    }
+
+    // Shift tail_ by n for one of several consumers.
+    void
+    reserve_tail_mc(ThrPos &tp, size_t n)
+    {
+        /*
+         * See comments for reserve_head_mp().
+         *
+         * Loads and stores are not reordered with locked instructions,
+         * se we don't need a memory barrier here.
+         */
+        P::log(&tp.tail, sizeof(tp.tail));
+        tp.tail = qi_->tail_;
+        P::persist(&tp.tail, sizeof(tp.tail));
+        CRASH_POINT("reserve_tail");
+        if (COMPACT) {
+            tp.tail = __sync_fetch_and_add(&qi_->tail_, n);
+        } else {
+            P::log(&qi_->tail_, sizeof(qi_->tail_));
+            tp.tail = __sync_fetch_and_add(&qi_->tail_, n);
+            P::flush(&qi_->tail_, sizeof(qi_->tail_));
+            P::flush(&tp.tail, sizeof(tp.tail));
+            CRASH_POINT("reserve_tail_flush");
+            P::drain();
+        }
+    }
+
+    /*
+     * Copy out n reserved slots starting at tp.tail and release them, but
+     * keep them from producers until ack().
+     * @return the position of the last one.
+     */
+    unsigned long
+    release_pending(ThrPos &tp, T *ptr, size_t n)
+    {
+        // The reserved slots are safe until the first one is unacked.
+        if (tp.unacked == ULONG_MAX) {
+            P::log(&tp.unacked, sizeof(tp.unacked));
+            tp.unacked = tp.tail;
+            P::persist(&tp.unacked, sizeof(tp.unacked));
+        }
+        copy_from_ring(tp.tail, ptr, n);
+        tp.pending = tp.tail + n - 1;
+        unsigned long pos = tp.pending;
+        release_tail(tp, n);
+        return pos;
+    }
+
+    // Give n consumed slots starting at tp.tail back to producers.
+    void
+    release_tail(ThrPos &tp, size_t n)
+    {
+        if (SC) {
+            // The items are copied out, see publish_head().
+            CRASH_POINT("release_tail");
+            P::log(&qi_->tail_, sizeof(qi_->tail_));
+            CMB();
+            qi_->tail_ = tp.tail + n;
+            P::persist(&qi_->tail_, sizeof(qi_->tail_));
+
+            // Allow producers to rewrite the slots.
+            qi_->last_tail_ = std::min(qi_->tail_, tp.unacked);
+            tail_ev_->notify();
+            return;
+        }
+        if (COMPACT) {
+            CRASH_POINT("release_tail");
+            tp.n_pop = n;
+            tp.pos_pop = tp.tail;
+            CMB();
+
+            // Allow producers to rewrite the slots.
+            tp.tail = ULONG_MAX;
+            P::persist(&tp.tail, sizeof(tp.tail) + sizeof(tp.pos_pop) +
+                       sizeof(tp.n_pop));
+            tail_ev_->notify();
+            return;
+        }
+
+        // See publish_head() for the ordering of n_pop and pos_pop.
+        P::log(&tp.pos_pop, sizeof(tp.pos_pop) + sizeof(tp.n_pop));
+        tp.n_pop = n;
+        tp.pos_pop = tp.tail;
+        CMB();
+        P::persist(&tp.pos_pop, sizeof(tp.pos_pop) + sizeof(tp.n_pop));
+        CRASH_POINT("release_tail");
+
+        // Allow producers to rewrite the slots.
+        tp.tail = ULONG_MAX;
+        P::persist(&tp.tail, sizeof(tp.tail));
+        tail_ev_->notify();
+    }
+
+    /*
+     * Reserve n slots to push to, starting at tp.head, if they are free.
+     * Unlike reserve_head() the head is only shifted once the slots are
+     * known to be free, so nothing is reserved when the queue is full.
+     * @return false if the queue is full.
+     */
+    bool
+    try_reserve_head(ThrPos &tp, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        if (SP) {
+            // Nothing is published before the slots are known free.
+            tp.head = qi_->head_;
+            if (UNLIKELY(tp.head + n > reuse_limit() + Q_SIZE))
+                update_last_tail();
+            return tp.head + n <= reuse_limit() + Q_SIZE;
+        }
+        P::log(&tp.head, sizeof(tp.head));
+        if (!COMPACT)
+            P::log(&qi_->head_, sizeof(qi_->head_));
+        tp.n_head = 0;
+        while (true) {
+            unsigned long head = qi_->head_;
+            /*
+             * Publish the head we are about to take before taking it,
+             * see reserve_head(). The compare-and-swap below fails if
+             * head_ moved in the meantime.
+             */
+            tp.head = head;
+            P::persist(&tp.head, sizeof(tp.head));
+
+            if (UNLIKELY(head + n > reuse_limit() + Q_SIZE)) {
+                // Update the last_tail_.
+                update_last_tail();
+
+                if (head + n > reuse_limit() + Q_SIZE) {
+                    // Full, give up without shifting the head.
+                    tp.head = ULONG_MAX;
+                    P::persist(&tp.head, sizeof(tp.head));
+                    head_ev_->notify();
+                    return false;
+                }
+            }
+
+            if (__sync_bool_compare_and_swap(&qi_->head_, head, head + n)) {
+                tp.n_head = n;
+                if (!COMPACT)
+                    P::persist(&qi_->head_, sizeof(qi_->head_));
+                return true;
+            }
+        }
+    }
+
+    /*
+     * Reserve n slots to pop from, starting at tp.tail, if they are
+     * written. See try_reserve_head().
+     * @return false if the queue is empty.
+     */
+    bool
+    try_reserve_tail(ThrPos &tp, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        if (SC) {
+            tp.tail = qi_->tail_;
+            if (UNLIKELY(tp.tail + n > qi_->last_head_))
+                update_last_head();
+            return tp.tail + n <= qi_->last_head_;
+        }
+        P::log(&tp.tail, sizeof(tp.tail));
+        if (!COMPACT)
+            P::log(&qi_->tail_, sizeof(qi_->tail_));
+        while (true) {
+            unsigned long tail = qi_->tail_;
+            tp.tail = tail;
+            P::persist(&tp.tail, sizeof(tp.tail));
+
+            if (UNLIKELY(tail + n > qi_->last_head_)) {
+                // Update the last_head_.
+                update_last_head();
+
+                if (tail + n > qi_->last_head_) {
+                    // Empty, give up without shifting the tail.
+                    tp.tail = ULONG_MAX;
+                    P::persist(&tp.tail, sizeof(tp.tail));
+                    tail_ev_->notify();
+                    return false;
+                }
+            }
+
+            if (__sync_bool_compare_and_swap(&qi_->tail_, tail, tail + n)) {
+                if (!COMPACT)
+                    P::persist(&qi_->tail_, sizeof(qi_->tail_));
+                return true;
+            }
+        }
+    }
+
+    // Init internal state.
+    void
+    init()
+    {
+        auto n = std::max(n_consumers_, n_producers_);
+        // Set per thread tail, head, and pos to ULONG_MAX.
+        ::memset((void *)thr_p_, 0xFF, sizeof(ThrPos) * n);
+
+        // Initialize queue parameters.
+        qi_->tail_      = 0;
+        qi_->head_      = 0;
+        qi_->last_head_ = 0;
+        qi_->last_tail_ = 0;
+        qi_->durable_head_ = 0;
+        qi_->durable_tail_ = 0;
+        ::memset(qi_->groups_, 0, sizeof(qi_->groups_));
+    }
+
+    // Copy cnt slots from ring position src to dst, without draining.
+    void
+    copy_slots(unsigned long dst, unsigned long src, unsigned long cnt)
+    {
+        while (cnt) {
+            auto d = dst & Q_MASK, s = src & Q_MASK;
+            auto run = std::min(cnt, Q_SIZE - std::max(d, s));
+
+            P::copy(&ptr_array_[d], &ptr_array_[s], run * sizeof(Slot));
+            dst += run;
+            src += run;
+            cnt -= run;
+        }
+    }
+
+    /*
+     * Move cnt slots from ring position src to dst. The ranges may
+     * overlap, so the move goes in blocks no longer than the distance,
+     * starting from the end it moves towards. Each block is split
+     * between the recovery threads.
+     */
+    void
+    move_slots(unsigned long dst, unsigned long src, unsigned long cnt)
+    {
+        if (dst == src || !cnt)
+            return;
+
+        unsigned long blk = std::min(cnt, dst > src ? dst - src : src - dst);
+        unsigned long min_slice = RECOVERY_SLICE / sizeof(T) + 1;
+        for (unsigned long done = 0; done < cnt; done += blk) {
+            auto b = std::min(blk, cnt - done);
+            auto off = dst > src ? cnt - done - b : done;
+
+            parallel_for(b, min_slice,
+            [&](unsigned long lo, unsigned long hi) {
+                copy_slots(dst + off + lo, src + off + lo, hi - lo);
+                pmem_drain();
+            });
+        }
+    }
+
+    /*
+     * Recover internal state.
+     *
+     * Completed pushes above last_head_ are moved down to close the holes
+     * left by in-flight pushes. Items not popped yet, i.e. the gaps below
+     * and between completed pops above last_tail_, are moved up against
+     * the last popped item. Both work on at most one range per thread,
+     * so the cost is linear in the number of slots moved.
+     */
+    void
+    recover()
+    {
+        PhaseTimer timer;
+
+        if (GROUP) {
+            /*
+             * The slots below the durable head are written, the ones
+             * below the durable tail are no longer needed. Later pushes
+             * are dropped and later pops are delivered again.
+             */
+            std::cout << "durable_head_=" << (qi_->durable_head_ & Q_MASK)
+                      << ", durable_tail_="
+                      << (qi_->durable_tail_ & Q_MASK) << std::endl;
+            qi_->head_ = qi_->last_head_ = qi_->durable_head_;
+            qi_->tail_ = qi_->last_tail_ = qi_->durable_tail_;
+            persist_range(qi_, sizeof(QInfo));
+
+            auto n = std::max(n_consumers_, n_producers_);
+            ::memset((void *)thr_p_, 0xFF, sizeof(ThrPos) * n);
+            persist_range(thr_p_, sizeof(ThrPos) * n);
+            timer.phase("metadata");
+            return;
+        }
+
+        if (COMPACT) {
+            // head_ and tail_ may lag behind the completed operations.
+            for (size_t i = 0; i < n_producers_; ++i) {
+                ThrPos &tp = thr_p_[i];
+                if (tp.pos_push != ULONG_MAX)
+                    qi_->head_ = std::max(qi_->head_,
+                                          tp.pos_push + tp.n_push);
+            }
+            for (size_t i = 0; i < n_consumers_; ++i) {
+                ThrPos &tp = thr_p_[i];
+                if (tp.pos_pop != ULONG_MAX)
+                    qi_->tail_ = std::max(qi_->tail_, tp.pos_pop + tp.n_pop);
+            }
+        }
+
+        // Update the last_head_.
+        qi_->last_head_ = find_last_head();
+        std::cout << "last_head_=" << (qi_->last_head_ & Q_MASK) << std::endl;
+
+        // Update the last_tail_.
+        qi_->last_tail_ = find_last_tail();
+        std::cout << "last_tail_=" << (qi_->last_tail_ & Q_MASK) << std::endl;
+
+        // Completed push and pop ranges sorted by position.
+        std::vector<std::pair<unsigned long, size_t>> pushed, popped;
+        pushed.reserve(n_producers_);
+        for (size_t i = 0; i < n_producers_; ++i) {
+            ThrPos &tp = thr_p_[i];
+            if (tp.head == ULONG_MAX &&
+                tp.pos_push > qi_->last_head_ &&
+                tp.pos_push != ULONG_MAX)
+                pushed.push_back(std::make_pair(tp.pos_push, i));
+        }
+        std::sort(pushed.begin(), pushed.end());
+
+        // Items popped by pop_pending() and not acked are not popped.
+        popped.reserve(n_consumers_);
+        for (size_t i = 0; i < n_consumers_; ++i) {
+            ThrPos &tp = thr_p_[i];
+            if (tp.tail == ULONG_MAX &&
+                tp.pos_pop > qi_->last_tail_ &&
+                tp.pos_pop < qi_->last_head_ &&
+                tp.pos_pop < tp.unacked &&
+                tp.pos_pop != ULONG_MAX)
+                popped.push_back(std::make_pair(tp.pos_pop, i));
+        }
+        std::sort(popped.begin(), popped.end());
+        timer.phase("scan");
+
+        // Move pushed ranges down to last_head_.
+        unsigned long n_pushed = 0;
+        for (auto &e : pushed) {
+            unsigned long cnt = thr_p_[e.second].n_push;
+            move_slots(qi_->last_head_ + n_pushed, e.first, cnt);
+            n_pushed += cnt;
+        }
+        std::cout << "recovery moved " << n_pushed << " pushed items"
+                  << std::endl;
+        timer.phase("push compaction");
+
+        // Move unpopped gaps up, starting from the top one.
+        unsigned long n_popped = 0, n_moved = 0;
+        if (!popped.empty()) {
+            auto &last = popped.back();
+            unsigned long dst = last.first + thr_p_[last.second].n_pop;
+            for (size_t k = popped.size(); k-- > 0;) {
+                n_popped += thr_p_[popped[k].second].n_pop;
+
+                // The gap below the k'th range starts after the previous one.
+                unsigned long lo = qi_->last_tail_;
+                if (k > 0)
+                    lo = popped[k - 1].first +
+                         thr_p_[popped[k - 1].second].n_pop;
+                unsigned long gap = popped[k].first - lo;
+
+                dst -= gap;
+                move_slots(dst, lo, gap);
+                n_moved += gap;
+            }
+            assert(dst == qi_->last_tail_ + n_popped);
+        }
+        std::cout << "recovery moved " << n_moved << " unpopped items"
+                  << std::endl;
+        timer.phase("pop compaction");
+
+        qi_->last_head_ += n_pushed;
+        qi_->head_ = qi_->last_head_;
+        qi_->last_tail_ += n_popped;
+        qi_->tail_ = qi_->last_tail_;
+        persist_range(qi_, sizeof(QInfo));
+
+        // Nothing is in flight and every completed range was applied.
+        for (size_t i = 0; i < n_producers_; ++i) {
+            thr_p_[i].head = ULONG_MAX;
+            thr_p_[i].pos_push = ULONG_MAX;
+        }
+        for (size_t i = 0; i < n_consumers_; ++i) {
+            thr_p_[i].tail = ULONG_MAX;
+            thr_p_[i].pos_pop = ULONG_MAX;
+            thr_p_[i].unacked = ULONG_MAX;
+        }
+        auto n = std::max(n_consumers_, n_producers_);
+        persist_range(thr_p_, sizeof(ThrPos) * n);
+        timer.phase("metadata");
+    }
+
+    /*
+     * Carve the queue out of a PMEM region, then recover or init it.
+     * Without alone other processes use it, so it is left as it is.
+     */
+    void
+    attach(char *ptr, bool alone = true)
+    {
+        auto n = std::max(n_consumers_, n_producers_);
+        uint64_t *magic = (uint64_t *)ptr;
+
+        size_t pagesize = getpagesize();
+        ptr += pagesize;
+        thr_p_ = (ThrPos *)ptr;
+
+        ptr += roundup(sizeof(ThrPos) * n, pagesize);
+        ptr_array_ = (Slot *)ptr;
+
+        ptr += roundup(Q_SIZE * sizeof(Slot), pagesize);
+        qi_ = (QInfo *)ptr;
+
+        // Check if we should recover
+        if (!alone) {
+            assert(*magic == MAGIC);
+        } else if (*magic == MAGIC) {
+            // Recover internal state.
+            recover();
+        } else {
+            // Init internal state.
+            init();
+            persist_range(magic, pmem_size());
+
+            // Once initialization is complete, set magic no.
+            *magic = MAGIC;
+            persist_range(magic, pagesize);
+        }
+
+        if (P::PERSISTENT && !GROUP && !is_pmem_)
+            std::cerr << name_ << " is not PMEM, " << P::name()
+                      << " operations are not durable, use adr-group"
+                      << std::endl;
+        if (GROUP)
+            persister_ = std::thread(&LockFreeQueue::persist_loop, this);
+    }
+
+    // @return true if process pid is gone and reaped.
+    static bool
+    pid_dead(unsigned long pid)
+    {
+        return ::kill(pid, 0) && errno == ESRCH;
+    }
+
+    /*
+     * Finish the push of a dead producer. If it got as far as publishing,
+     * its items are whole; otherwise they are zeroed, so consumers find
+     * all-zero items in their place.
+     * @return false if it died between taking head_ and recording its
+     * slots, which only recovery can sort out.
+     */
+    bool
+    reclaim_head(ThrPos &tp)
+    {
+        // A single producer moves head_ only once its items are whole.
+        if (SP || tp.head == ULONG_MAX)
+            return true;
+        if (!tp.n_head)
+            return false;
+
+        auto n = tp.n_head;
+        if (tp.pos_push != tp.head || tp.n_push != n) {
+            // It may have died waiting for room.
+            tail_ev_->wait_until([&] {
+                update_last_tail();
+                return tp.head + n <= reuse_limit() + Q_SIZE;
+            });
+            for (auto pos = tp.head; pos < tp.head + n; ++pos) {
+                auto &item = ptr_array_[pos & Q_MASK].item;
+                ::memset((void *)&item, 0, sizeof(T));
+                P::flush(&item, sizeof(T));
+            }
+        }
+        publish_head(tp, n);
+        return true;
+    }
+
+    // Drop the items a dead consumer reserved or did not ack.
+    void
+    reclaim_tail(ThrPos &tp)
+    {
+        if (!SC && tp.tail != ULONG_MAX) {
+            tp.tail = ULONG_MAX;
+            P::persist(&tp.tail, sizeof(tp.tail));
+        }
+        if (tp.unacked != ULONG_MAX) {
+            tp.unacked = ULONG_MAX;
+            P::persist(&tp.unacked, sizeof(tp.unacked));
+        }
+        if (SC)
+            qi_->last_tail_ = qi_->tail_;
+        else
+            update_last_tail();
+        tail_ev_->notify();
+    }
+
+    // Reclaim slot i of role if its owner is dead.
+    bool
+    reclaim_slot(ThrRole role, size_t i)
+    {
+        ThrPos &tp = thr_p_[i];
+        auto pid = tp.owner[role];
+        if (pid == ULONG_MAX || !pid_dead(pid))
+            return false;
+        // Only one process reclaims it. If that one dies, the next does.
+        unsigned long self = ::getpid();
+        if (!__sync_bool_compare_and_swap(&tp.owner[role], pid, self))
+            return false;
+
+        if (role == PRODUCER && !reclaim_head(tp)) {
+            std::cout << "producer " << i << " died taking its slots, "
+                      << "the queue needs recovery" << std::endl;
+            tp.owner[role] = pid;
+            return false;
+        }
+        if (role == CONSUMER)
+            reclaim_tail(tp);
+        tp.owner[role] = ULONG_MAX;
+        P::persist(&tp.owner[role], sizeof(tp.owner[role]));
+        return true;
+    }
+
+    /*
+     * Map the queue file. With transactions it is a libpmemobj pool
+     * holding the queue as its root object, so the undo logs of
+     * interrupted operations are rolled back when it is opened.
+     */
+    char *
+    pmem_open()
+    {
+        std::string path;
+        pmem_path(path);
+        if (!P::TX)
+            return (char *)pmempool_alloc(path, pmem_size());
+
+        // Force-disable SDS feature during pool creation.
+        int sds_write_value = 0;
+        pmemobj_ctl_set(NULL, "sds.at_create", &sds_write_value);
+
+        pop_ = pmemobj_open(path.c_str(), "queue");
+        if (!pop_) {
+            // Leave room for the heap metadata and the lanes.
+            pop_ = pmemobj_create(path.c_str(), "queue",
+                                  pmem_size() + 4 * PMEMOBJ_MIN_POOL, 0666);
+        }
+        if (!pop_) {
+            std::cerr << pmemobj_errormsg() << std::endl;
+            return NULL;
+        }
+        char *ptr = (char *)pmemobj_direct(pmemobj_root(pop_, pmem_size()));
+        // libpmemobj itself falls back to msync().
+        is_pmem_ = pmem_is_pmem(ptr, pmem_size());
+        return ptr;
+    }
+
+    // Runs one operation in a transaction of the policy, if it has any.
+    struct TxScope {
+        TxScope(PMEMobjpool *pop)
+        {
+            P::tx_begin(pop);
+        }
+
+        ~TxScope()
+        {
+            P::tx_end();
+        }
+    };
+
+public:
+    /*
+     * Open or create the queue. A volatile queue lives in DRAM, a
+     * persistent one in the file "queue" under PMEM_DAXFS_PATH.
+     */
+    LockFreeQueue(size_t n_producers, size_t n_consumers)
+        : n_producers_(n_producers),
+          n_consumers_(n_consumers),
+          pool_(NULL),
+          pop_(NULL),
+          head_ev_(&own_ev_[0]),
+          tail_ev_(&own_ev_[1]),
+          stop_(false),
+          name_("queue"),
+          lock_fd_(-1),
+          is_pmem_(P::PERSISTENT)
+    {
+        assert(!SP || n_producers == 1);
+        assert(!SC || n_consumers == 1);
+        auto n = std::max(n_consumers, n_producers);
+        if (P::PERSISTENT) {
+            char *ptr = pmem_open();
+            assert(ptr);
+            attach(ptr);
+        } else {
+            thr_p_ = (ThrPos *)::memalign(getpagesize(),
+                                          sizeof(ThrPos) * n);
+
+            ptr_array_ = (Slot *)::memalign(getpagesize(),
+                                            Q_SIZE * sizeof(Slot));
+
+            qi_ = (QInfo *)::memalign(getpagesize(),
+                                      sizeof(QInfo));
+
+            assert(thr_p_);
+            assert(ptr_array_);
+            assert(qi_);
+            first_touch(ptr_array_, Q_SIZE * sizeof(Slot));
+
+            // Init internal state.
+            init();
+        }
+
+    }
+
+    // Open or create the queue called name in a pool directory.
+    LockFreeQueue(pool_dir_t *pool, const char *name,
+                  size_t n_producers, size_t n_consumers)
+        : n_producers_(n_producers),
+          n_consumers_(n_consumers),
+          pool_(pool),
+          pop_(NULL),
+          head_ev_(&own_ev_[0]),
+          tail_ev_(&own_ev_[1]),
+          stop_(false),
+          name_(name),
+          lock_fd_(-1),
+          is_pmem_(pool->is_pmem)
+    {
+        assert(!SP || n_producers == 1);
+        assert(!SC || n_consumers == 1);
+        static_assert(P::PERSISTENT && !P::TX,
+                      "pool directories hold log-free persistent queues");
+        uint64_t geom[POOL_GEOM_LEN] = {Q_SIZE, sizeof(Slot), n_producers,
+                                        n_consumers
+                                       };
+        char *ptr = (char *)pool_dir_get(pool, name, MAGIC, geom,
+                                         pmem_size());
+        assert(ptr);
+        attach(ptr);
+    }
+
+    /*
+     * Open or create the queue in the file name under PMEM_DAXFS_PATH,
+     * shared with every process opening the same name. A volatile one
+     * works as well, e.g. in /dev/shm. The first process to open it
+     * recovers it; producers and consumers then join() it.
+     */
+    LockFreeQueue(const char *name, size_t n_producers, size_t n_consumers)
+        : n_producers_(n_producers),
+          n_consumers_(n_consumers),
+          pool_(NULL),
+          pop_(NULL),
+          head_ev_(&own_ev_[0]),
+          tail_ev_(&own_ev_[1]),
+          stop_(false),
+          name_(name),
+          lock_fd_(-1),
+          is_pmem_(true)
+    {
+        assert(!SP || n_producers == 1);
+        assert(!SC || n_consumers == 1);
+        static_assert(!P::GROUP && !P::TX,
+                      "processes share queues without a persister or logs");
+        std::string path;
+        pmem_path(path);
+        lock_fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+        assert(lock_fd_ >= 0);
+        char *ptr = (char *)pmempool_alloc(path, pmem_size());
+        assert(ptr);
+
+        /*
+         * Every process holds a shared lock on the file while it has the
+         * queue open, so the one getting an exclusive lock is alone and
+         * may recover. A magic number still missing under the shared
+         * lock means that the process initializing the queue died.
+         */
+        bool alone;
+        while (!(alone = !::flock(lock_fd_, LOCK_EX | LOCK_NB))) {
+            ::flock(lock_fd_, LOCK_SH);
+            if (*(uint64_t *)ptr == MAGIC)
+                break;
+            ::flock(lock_fd_, LOCK_UN);
+        }
+        attach(ptr, alone);
+        if (alone) {
+            // Owners of a previous run are gone.
+            for (size_t i = 0; i < std::max(n_consumers, n_producers); ++i)
+                thr_p_[i].owner[PRODUCER] = thr_p_[i].owner[CONSUMER] =
+                                                ULONG_MAX;
+            persist_range(thr_p_, sizeof(ThrPos) *
+                          std::max(n_consumers, n_producers));
+            qi_->ev_[0].reset(true);
+            qi_->ev_[1].reset(true);
+            ::flock(lock_fd_, LOCK_SH);
+        }
+        head_ev_ = &qi_->ev_[0];
+        tail_ev_ = &qi_->ev_[1];
+    }
+
+    ~LockFreeQueue()
+    {
+        if (persister_.joinable()) {
+            stop_.store(true);
+            persister_.join();
+        }
+        if (P::TX) {
+            pmemobj_close(pop_);
+        } else if (P::PERSISTENT || lock_fd_ >= 0) {
+            char *ptr = (char *)thr_p_ - getpagesize();
+            // A pool directory owns its mapping.
+            if (!pool_)
+                pmem_unmap(ptr, pmem_size());
+        } else {
+            ::free(ptr_array_);
+            ::free(thr_p_);
+            ::free(qi_);
+        }
+        // Other processes may recover the queue once the last one closes.
+        if (lock_fd_ >= 0)
+            ::close(lock_fd_);
+    }
+
+    /*
+     * Register the calling process as the producer or the consumer of a
+     * free ThrPos slot of a shared queue, after reclaiming the slots of
+     * dead processes. Its thread then passes the index to set_thr_id().
+     * @return the index, or -1 if all slots of the role are taken.
+     */
+    long
+    join(ThrRole role)
+    {
+        assert(lock_fd_ >= 0);
+        reclaim();
+        unsigned long self = ::getpid();
+        auto n = role == PRODUCER ? n_producers_ : n_consumers_;
+        for (size_t i = 0; i < n; ++i) {
+            auto &owner = thr_p_[i].owner[role];
+            if (__sync_bool_compare_and_swap(&owner, ULONG_MAX, self)) {
+                P::persist(&owner, sizeof(owner));
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Give slot i back once the process is done with it, see join().
+    void
+    leave(ThrRole role, size_t i)
+    {
+        auto &owner = thr_p_[i].owner[role];
+        assert(owner == (unsigned long)::getpid());
+        assert(role == PRODUCER || thr_p_[i].unacked == ULONG_MAX);
+        owner = ULONG_MAX;
+        P::persist(&owner, sizeof(owner));
+    }
+
+    /*
+     * Reclaim the slots of processes that died owning them. A push in
+     * flight is finished with zeroed items, pops in flight and unacked
+     * items are dropped. Until then a dead process may hold the other
+     * side back, so call this when a participant exits; a process only
+     * counts as dead once it was reaped.
+     * @return the number of slots reclaimed.
+     */
+    size_t
+    reclaim()
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < n_producers_; ++i)
+            n += reclaim_slot(PRODUCER, i);
+        for (size_t i = 0; i < n_consumers_; ++i)
+            n += reclaim_slot(CONSUMER, i);
+        return n;
+    }
+
+    ThrPos &
+    thr_pos() const
+    {
+        assert(ThrId() < std::max(n_consumers_, n_producers_));
+        return thr_p_[ThrId()];
+    }
+
+    unsigned long
+    push(T *ptr)
+    {
+        return push_n(ptr, 1);
+    }
+
+    /*
+     * Push n consecutive items. The whole batch is reserved with one
+     * fetch-and-add on head_, copied with a single flush/drain sequence,
+     * and published through ThrPos in one step.
+     * @return the sequence number to pass to wait_durable().
+     */
+    unsigned long
+    push_n(T *ptr, size_t n)
+    {
+#ifdef TIME_PUSH
+        TIMER_HP_REGISTER();
+        TIMER_HP_START("push");
+#endif
+
+        ThrPos &tp = thr_pos();
+        TxScope tx(pop_);
+        reserve_head(tp, n);
+
+        //ptr_array_[tp.head & Q_MASK] = *ptr;
+        copy_to_ring(tp.head, ptr, n);
+        CRASH_POINT("copy");
+        // publish_head() forgets the position.
+        unsigned long seq = tp.head + n;
+        publish_head(tp, n);
+#ifdef TIME_PUSH
+        lat_record(LAT_PUSH, TIMER_HP_ELAPSED());
+#endif
+        return seq;
+    }
+
+    /*
+     * Push n items that recover() keeps or drops as a whole, e.g. the
+     * records of one logical group. push_n() already publishes its range
+     * with a single durable record (head_ with SP, the ThrPos head line
+     * otherwise, durable_head_ with group commit), so this is push_n()
+     * with the guarantee spelled out. It costs one reservation and one
+     * drain for the whole group.
+     */
+    unsigned long
+    push_atomic(T *ptr, size_t n)
+    {
+        assert(n > 0 && n <= Q_SIZE);
+        return push_n(ptr, n);
+    }
+
+    /*
+     * Wait until the items pushed up to sequence number seq are durable.
+     * Only needed with group commit, pushes are durable on return
+     * otherwise.
+     */
+    void
+    wait_durable(unsigned long seq)
+    {
+        if (!GROUP)
+            return;
+        durable_ev_.wait_until([&] {
+            CMB();
+            return qi_->durable_head_ >= seq;
+        });
+    }
+
+    /*
+     * Reserve the next slot and return a pointer to it, so the caller
+     * can build the item in place. The item becomes visible to
+     * consumers only after commit(), which also ends the transaction
+     * started here.
+     */
+    T *
+    reserve()
+    {
+        ThrPos &tp = thr_pos();
+        P::tx_begin(pop_);
+        reserve_head(tp, 1);
+        return &ptr_array_[tp.head & Q_MASK].item;
+    }
+
+    // Persist and publish the slot returned by reserve().
+    void
+    commit()
+    {
+        ThrPos &tp = thr_pos();
+        assert(tp.head != ULONG_MAX);
+        P::flush(&ptr_array_[tp.head & Q_MASK].item, sizeof(T));
+        publish_head(tp, 1);
+        P::tx_end();
+    }
+
+    void
+    pop(T *ptr)
+    {
+        pop_n(ptr, 1);
+    }
+
+    /*
+     * Pop n consecutive items. The batch is reserved with one
+     * fetch-and-add on tail_ and released through ThrPos in one step.
+     */
+    void
+    pop_n(T *ptr, size_t n)
+    {
+#ifdef TIME_POP
+        TIMER_HP_REGISTER();
+        TIMER_HP_START("pop");
+#endif
+
+        ThrPos &tp = thr_pos();
+        TxScope tx(pop_);
+        reserve_tail(tp, n);
+
+        copy_from_ring(tp.tail, ptr, n);
+        release_tail(tp, n);
+#ifdef TIME_POP
+        lat_record(LAT_POP, TIMER_HP_ELAPSED());
+#endif
+    }
+
+    /*
+     * Reserve the next item and return a pointer to it in the ring,
+     * so the caller can parse it in place. Producers do not reuse the
+     * slot until release(), which also ends the transaction started
+     * here.
+     */
+    const T *
+    borrow()
+    {
+        ThrPos &tp = thr_pos();
+        P::tx_begin(pop_);
+        reserve_tail(tp, 1);
+        return &ptr_array_[tp.tail & Q_MASK].item;
+    }
+
+    // Give the slot returned by borrow() back to producers.
+    void
+    release()
+    {
+        ThrPos &tp = thr_pos();
+        assert(tp.tail != ULONG_MAX);
+        release_tail(tp, 1);
+        P::tx_end();
+    }
+
+    bool
+    try_push(T *ptr)
+    {
+        return try_push_n(ptr, 1);
+    }
+
+    /*
+     * Push n consecutive items if there is room for all of them.
+     * @return false, without reserving anything, if the queue is full.
+     */
+    bool
+    try_push_n(T *ptr, size_t n)
+    {
+        ThrPos &tp = thr_pos();
+        TxScope tx(pop_);
+        if (!try_reserve_head(tp, n))
+            return false;
+
+        copy_to_ring(tp.head, ptr, n);
+        publish_head(tp, n);
+        return true;
+    }
+
+    /*
+     * Push an item, waiting at most usec microseconds for room.
+     * @return false if the queue stayed full.
+     */
+    bool
+    try_push_for(T *ptr, unsigned long usec)
+    {
+        auto deadline = get_timestamp() + usec;
+        do {
+            if (try_push(ptr))
+                return true;
+            _mm_pause();
+        } while (get_timestamp() < deadline);
+        return false;
+    }
+
+    bool
+    try_pop(T *ptr)
+    {
+        return try_pop_n(ptr, 1);
+    }
+
+    /*
+     * Pop n consecutive items if all of them are available.
+     * @return false, without reserving anything, if the queue is empty.
+     */
+    bool
+    try_pop_n(T *ptr, size_t n)
+    {
+        ThrPos &tp = thr_pos();
+        TxScope tx(pop_);
+        if (!try_reserve_tail(tp, n))
+            return false;
+
+        copy_from_ring(tp.tail, ptr, n);
+        release_tail(tp, n);
+        return true;
+    }
+
+    /*
+     * Pop an item, waiting at most usec microseconds for one.
+     * @return false if the queue stayed empty.
+     */
+    bool
+    try_pop_for(T *ptr, unsigned long usec)
+    {
+        auto deadline = get_timestamp() + usec;
+        do {
+            if (try_pop(ptr))
+                return true;
+            _mm_pause();
+        } while (get_timestamp() < deadline);
+        return false;
+    }
+
+    unsigned long
+    pop_pending(T *ptr)
+    {
+        return pop_pending_n(ptr, 1);
+    }
+
+    /*
+     * Pop n items like pop_n(), but keep their slots until ack(). If the
+     * process crashes before, recover() hands them out again, so items
+     * are delivered at least once. Only the first pop after an ack()
+     * persists anything more than pop_n().
+     * @return the position of the last item, to pass to ack().
+     */
+    unsigned long
+    pop_pending_n(T *ptr, size_t n)
+    {
+        ThrPos &tp = thr_pos();
+        TxScope tx(pop_);
+        reserve_tail(tp, n);
+        return release_pending(tp, ptr, n);
+    }
+
+    /*
+     * Pop n items like pop_pending_n() if there are so many. Unacked
+     * items keep producers from reusing their slots, so ack() them
+     * before waiting for more.
+     * @return false if there are not, otherwise the position in pos.
+     */
+    bool
+    try_pop_pending_n(T *ptr, size_t n, unsigned long *pos)
+    {
+        ThrPos &tp = thr_pos();
+        TxScope tx(pop_);
+        if (!try_reserve_tail(tp, n))
+            return false;
+        *pos = release_pending(tp, ptr, n);
+        return true;
+    }
+
+    /*
+     * Acknowledge all items the calling consumer got from pop_pending()
+     * up to position pos, so producers may reuse their slots. Acks are
+     * cumulative, one per batch of pops is enough.
+     */
+    void
+    ack(unsigned long pos)
+    {
+        ThrPos &tp = thr_pos();
+        assert(tp.unacked != ULONG_MAX && pos >= tp.unacked);
+        TxScope tx(pop_);
+
+        // Later pops of this consumer are above pos.
+        P::log(&tp.unacked, sizeof(tp.unacked));
+        tp.unacked = pos >= tp.pending ? ULONG_MAX : pos + 1;
+        P::persist(&tp.unacked, sizeof(tp.unacked));
+
+        if (SC)
+            qi_->last_tail_ = std::min(qi_->tail_, tp.unacked);
+        else
+            update_last_tail();
+        tail_ev_->notify();
+    }
+
+    // The queue was mapped from PMEM rather than through the page cache.
+    bool
+    is_pmem() const
+    {
+        return is_pmem_;
+    }
+
+    /*
+     * Every pushed item is taken by a pop, which may still be copying it.
+     * Only meaningful while no push is in flight.
+     */
+    bool
+    drained() const
+    {
+        return qi_->tail_ >= qi_->head_;
+    }
+
+private:
+    template<class, class, decltype(thr_id), unsigned long, bool>
+    friend class LockFreeLog;
+
+    /*
+     * The most hot members are cacheline aligned to avoid
+     * False Sharing.
+     */
+
+    struct LogGroup {
+        // next item to read
+        unsigned long offset ____cacheline_aligned;
+        // empty if the entry is free (same cache line)
+        char name[LOG_NAME_LEN];
+    };
+
+    struct QInfo {
+        // currently free position (next to insert)
+        unsigned long head_ ____cacheline_aligned;
+        // current tail, next to pop
+        unsigned long tail_ ____cacheline_aligned;
+        // last not-processed producer's pointer
+        unsigned long last_head_ ____cacheline_aligned;
+        // last not-processed consumer's pointer
+        unsigned long last_tail_ ____cacheline_aligned;
+        // group commit: all pushes below are durable
+        unsigned long durable_head_ ____cacheline_aligned;
+        // group commit: all pops below are durable (same cache line)
+        unsigned long durable_tail_;
+        // consumer groups of a LockFreeLog
+        LogGroup groups_[LOG_GROUPS];
+        // head_ev_ and tail_ev_ of a queue shared by processes
+        WaitEvent ev_[2];
+    };
+
+    const size_t  n_producers_, n_consumers_;
+    // Pool hosting the queue, NULL if it has its own file.
+    pool_dir_t    *pool_;
+    // libpmemobj pool of a transactional queue.
+    PMEMobjpool   *pop_;
+    QInfo         *qi_;
+    ThrPos        *thr_p_;
+    Slot          *ptr_array_;
+    /*
+     * Sleeping consumers wait for head_ev_, producers for tail_ev_.
+     * They are own_ev_, or qi_->ev_ if processes share the queue.
+     */
+    WaitEvent     own_ev_[2];
+    WaitEvent     *head_ev_, *tail_ev_;
+    // Group commit: persister thread and callers of wait_durable().
+    std::thread   persister_;
+    std::atomic<bool> stop_;
+    WaitEvent     durable_ev_;
+    // Only one thread at a time scans for last_head_ and last_tail_.
+    Combiner      head_scan_, tail_scan_;
+    // File of the queue under PMEM_DAXFS_PATH, or name in the pool.
+    std::string   name_;
+    // Locked while processes share the queue, -1 if it is not shared.
+    int           lock_fd_;
+    // The file is PMEM, group commit uses msync() otherwise.
+    bool          is_pmem_;
+};
+
+#endif /* Q_LF_QUEUE_H */
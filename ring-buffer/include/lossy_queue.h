@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_LOSSY_QUEUE_H
+#define Q_LOSSY_QUEUE_H
+
+#include <malloc.h>
+#include <string.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include <libpmem.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+
+#include "config.h"
+#include "util.h"
+#include "wait.h"
+#include "timer.h"
+#include "persist.h"
+#include "histogram.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Lossy overwrite-oldest ring for telemetry.
+ *
+ * Producers never wait for consumers: a push takes the next position
+ * with one fetch-and-add and writes its slot even if the item there was
+ * not consumed yet. Every slot carries the position it holds, so a
+ * consumer finds out whether its position was overwritten, and skips
+ * what a lap of producers has passed at once. Skipped items are counted
+ * in drops().
+ *
+ * A slot's seq is p while it holds the item of position p, p | BUSY while
+ * a producer writes it and p | HOLE if the item of p was lost in a crash.
+ * A producer persists BUSY before it touches the item, so recovery tells
+ * torn slots from whole ones; head_ is the highest position found plus
+ * one and the window is the last Q_SIZE positions not consumed.
+ *
+ * Consumers persist tail_ after every item, so an item being copied out
+ * by another consumer at a crash may be lost; nothing is delivered twice.
+ * Positions start at Q_SIZE, so initial slots look consumed.
+ * ------------------------------------------------------------------------
+ */
+template<class T, class P = Adr, unsigned long Q_SIZE = QUEUE_SIZE>
+class LossyQueue {
+private:
+    static const unsigned long Q_MASK = Q_SIZE - 1;
+    static const unsigned long BUSY = 1UL << 63;
+    static const unsigned long HOLE = 1UL << 62;
+    static const unsigned long POS = HOLE - 1;
+
+    static_assert(!P::GROUP && !P::TX,
+                  "lossy queues persist slot by slot");
+
+#ifdef XPLINE_SLOTS
+    struct alignas(XPLINE_SIZE) Slot {
+        std::atomic<unsigned long> seq;
+        T item;
+    };
+#else
+    struct Slot {
+        std::atomic<unsigned long> seq;
+        T item;
+    };
+#endif
+
+    struct QInfo {
+        // next position to push
+        std::atomic<unsigned long> head_ ____cacheline_aligned;
+        // next position to pop
+        std::atomic<unsigned long> tail_ ____cacheline_aligned;
+    };
+
+    size_t
+    pmem_size() const
+    {
+        auto pagesize = getpagesize();
+        return pagesize + roundup(sizeof(QInfo), pagesize) +
+               roundup(Q_SIZE * sizeof(Slot), pagesize);
+    }
+
+    void
+    init()
+    {
+        for (unsigned long i = 0; i < Q_SIZE; ++i)
+            ptr_array_[i].seq.store(i);
+        qi_->head_.store(Q_SIZE);
+        qi_->tail_.store(Q_SIZE);
+    }
+
+    // Rebuild head_ and the window from the slot stamps.
+    void
+    recover()
+    {
+        unsigned long head = Q_SIZE;
+        for (unsigned long i = 0; i < Q_SIZE; ++i)
+            head = std::max(head, (ptr_array_[i].seq.load() & POS) + 1);
+
+        unsigned long tail = std::max(qi_->tail_.load(), head - Q_SIZE);
+        tail = std::min(tail, head);
+        for (unsigned long p = head - Q_SIZE; p < head; ++p) {
+            Slot &s = ptr_array_[p & Q_MASK];
+            // Torn or never written: consumers skip it.
+            if (s.seq.load() != p && p >= tail)
+                s.seq.store(p | HOLE);
+            else if (s.seq.load() & BUSY)
+                s.seq.store((s.seq.load() & POS) | HOLE);
+        }
+        qi_->head_.store(head);
+        qi_->tail_.store(tail);
+        pmem_persist(qi_, sizeof(QInfo));
+        pmem_persist(ptr_array_, Q_SIZE * sizeof(Slot));
+        std::cout << "lossy recovery: " << head - tail
+                  << " items in the window" << std::endl;
+    }
+
+    /*
+     * Move tail_ up to the oldest position producers have not lapped.
+     * @return false if there is nothing left to pop.
+     */
+    bool
+    catch_up(unsigned long &t)
+    {
+        auto h = qi_->head_.load();
+        while (h - t > Q_SIZE) {
+            if (qi_->tail_.compare_exchange_weak(t, h - Q_SIZE)) {
+                drops_.fetch_add(h - Q_SIZE - t, std::memory_order_relaxed);
+                t = h - Q_SIZE;
+                break;
+            }
+        }
+        return t < h;
+    }
+
+    /*
+     * Copy the item of position p out of its slot.
+     * @return false if it was overwritten or lost.
+     */
+    bool
+    read_slot(unsigned long p, T *ptr)
+    {
+        Slot &s = ptr_array_[p & Q_MASK];
+        unsigned long seq;
+
+        // The producer of p took it already, it may still be writing.
+        while (((seq = s.seq.load()) & POS) < p ||
+                seq == (p | BUSY))
+            _mm_pause();
+        if (seq != p) {
+            drops_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        memcpy(ptr, &s.item, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load() != p) {
+            drops_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        P::persist(&qi_->tail_, sizeof(qi_->tail_));
+        return true;
+    }
+
+public:
+    // Open or create the queue. A persistent one lives in "lossy".
+    LossyQueue()
+        : drops_(0)
+    {
+        auto pagesize = getpagesize();
+        char *ptr;
+
+        if (P::PERSISTENT) {
+            ptr = (char *)pmem_map_file(PMEM_DAXFS_PATH "/lossy", pmem_size(),
+                                        PMEM_FILE_CREATE, 0666, NULL, NULL);
+        } else {
+            ptr = (char *)::memalign(pagesize, pmem_size());
+        }
+        assert(ptr);
+        uint64_t *magic = (uint64_t *)ptr;
+        qi_ = (QInfo *)(ptr + pagesize);
+        ptr_array_ = (Slot *)(ptr + pagesize +
+                              roundup(sizeof(QInfo), pagesize));
+
+        if (!P::PERSISTENT) {
+            init();
+        } else if (*magic == LOSSY_QUEUE_MAGIC) {
+            recover();
+        } else {
+            init();
+            pmem_persist(ptr, pmem_size());
+            *magic = LOSSY_QUEUE_MAGIC;
+            pmem_persist(magic, sizeof(*magic));
+        }
+    }
+
+    ~LossyQueue()
+    {
+        char *ptr = (char *)qi_ - getpagesize();
+        if (P::PERSISTENT)
+            pmem_unmap(ptr, pmem_size());
+        else
+            ::free(ptr);
+    }
+
+    /*
+     * Push an item, overwriting the oldest one if the ring is full.
+     * Waits at most for a producer a whole lap behind to finish its
+     * slot, never for a consumer.
+     */
+    void
+    push(T *ptr)
+    {
+#ifdef TIME_PUSH
+        TIMER_HP_REGISTER();
+        TIMER_HP_START("push");
+#endif
+        auto p = qi_->head_.fetch_add(1);
+        Slot &s = ptr_array_[p & Q_MASK];
+
+        auto seq = s.seq.load();
+        while (true) {
+            // A newer item is there already: ours is dropped.
+            if ((seq & POS) > p)
+                goto out;
+            if (UNLIKELY(seq & BUSY)) {
+                _mm_pause();
+                seq = s.seq.load();
+                continue;
+            }
+            if (s.seq.compare_exchange_weak(seq, p | BUSY))
+                break;
+        }
+        // Torn slots must not look whole after a crash.
+        P::persist(&s.seq, sizeof(s.seq));
+        P::copy(&s.item, ptr, sizeof(T));
+        P::drain();
+        s.seq.store(p, std::memory_order_release);
+        P::persist(&s.seq, sizeof(s.seq));
+        head_ev_.notify();
+out:
+#ifdef TIME_PUSH
+        lat_record(LAT_PUSH, TIMER_HP_ELAPSED());
+#endif
+        return;
+    }
+
+    void
+    push_n(T *ptr, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            push(ptr + i);
+    }
+
+    /*
+     * Pop the oldest item not overwritten yet.
+     * @return false if there is none.
+     */
+    bool
+    try_pop(T *ptr)
+    {
+        auto t = qi_->tail_.load();
+        while (catch_up(t)) {
+            if (!qi_->tail_.compare_exchange_weak(t, t + 1))
+                continue;
+            if (read_slot(t, ptr))
+                return true;
+            t = qi_->tail_.load();
+        }
+        return false;
+    }
+
+    // Pop an item, waiting while the ring is empty.
+    void
+    pop(T *ptr)
+    {
+        head_ev_.wait_until([&] {
+            return try_pop(ptr);
+        });
+    }
+
+    void
+    pop_n(T *ptr, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            pop(ptr + i);
+    }
+
+    // Items overwritten or lost before a consumer got them.
+    unsigned long
+    drops() const
+    {
+        return drops_.load();
+    }
+
+private:
+    QInfo                       *qi_;
+    Slot                        *ptr_array_;
+    // Sleeping consumers wait for a push.
+    WaitEvent                   head_ev_;
+    std::atomic<unsigned long>  drops_;
+};
+
+#endif /* Q_LOSSY_QUEUE_H */
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_PERSIST_H
+#define Q_PERSIST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <libpmem.h>
+#include <libpmemobj.h>
+
+#include "config.h"
+#include "util.h"
+#include "pmem_copy.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Persistence policies of LockFreeQueue (lf_queue.h).
+ *
+ * Volatile    DRAM, nothing is persisted.
+ * Eadr        PMEM with persistent caches. Stores only have to leave the
+ *             store buffer, so persisting is a store fence.
+ * Adr         log-free PMEM. Every position is flushed and fenced.
+ * AdrCompact  Adr with one cache line per role, see CompactThrPos.
+ * AdrGroup    Adr with group commit. Operations persist nothing, a
+ *             persister thread writes back many of them at once, with
+ *             msync() if the file is not PMEM.
+ * Msync       AdrGroup always writing back with msync().
+ * AdrTx       Adr with a libpmemobj undo-log transaction per operation.
+ *             Metadata is logged before it is changed and written back
+ *             on commit instead of persisted store by store.
+ *
+ * The queue calls the hooks unconditionally, so every policy compiles
+ * to branch-free code. Per-operation hooks do not reach storage through
+ * the page cache, so only group commit is durable on a file that is not
+ * PMEM. A policy derives from the one it differs least
+ * from and hides what it changes.
+ * ------------------------------------------------------------------------
+ */
+struct Volatile {
+    static const bool PERSISTENT = false;
+    static const bool COMPACT = false;
+    static const bool GROUP = false;
+    static const bool MSYNC = false;
+    static const bool TX = false;
+    static const uint64_t MAGIC = 0;
+
+    static const char *
+    name()
+    {
+        return "volatile";
+    }
+
+    // Copy items into the ring, without a fence.
+    static void
+    copy(void *dst, const void *src, size_t len)
+    {
+        ::memcpy(dst, src, len);
+    }
+
+    static void
+    flush(const void *, size_t)
+    {}
+
+    // Order the copies and flushes before the following stores.
+    static void
+    drain()
+    {}
+
+    // Make a store durable before the following ones.
+    static void
+    persist(const void *, size_t)
+    {}
+
+    // Undo-log a range the current operation is about to change.
+    static void
+    log(const void *, size_t)
+    {}
+
+    static void
+    tx_begin(PMEMobjpool *)
+    {}
+
+    static void
+    tx_end()
+    {}
+};
+
+struct Eadr : Volatile {
+    static const bool PERSISTENT = true;
+    static const uint64_t MAGIC = QUEUE_MAGIC;
+
+    static const char *
+    name()
+    {
+        return "eadr";
+    }
+
+    static void
+    copy(void *dst, const void *src, size_t len)
+    {
+        pmem_copy_nodrain(dst, src, len, true);
+    }
+
+    static void
+    drain()
+    {
+        SFENCE();
+    }
+
+    static void
+    persist(const void *, size_t)
+    {
+        SFENCE();
+    }
+};
+
+struct Adr : Volatile {
+    static const bool PERSISTENT = true;
+    static const uint64_t MAGIC = QUEUE_MAGIC;
+
+    static const char *
+    name()
+    {
+        return "adr";
+    }
+
+    static void
+    copy(void *dst, const void *src, size_t len)
+    {
+        pmem_copy_nodrain(dst, src, len);
+    }
+
+    static void
+    flush(const void *addr, size_t len)
+    {
+        pmem_flush(addr, len);
+    }
+
+    static void
+    drain()
+    {
+        pmem_drain();
+    }
+
+    static void
+    persist(const void *addr, size_t len)
+    {
+        pmem_persist(addr, len);
+    }
+};
+
+struct AdrCompact : Adr {
+    static const bool COMPACT = true;
+    static const uint64_t MAGIC = COMPACT_QUEUE_MAGIC;
+
+    static const char *
+    name()
+    {
+        return "adr-compact";
+    }
+};
+
+/*
+ * Group commit copies with cached stores, so the items are visible
+ * without a fence and the persister can write them back from its own CPU.
+ */
+struct AdrGroup : Volatile {
+    static const bool PERSISTENT = true;
+    static const bool GROUP = true;
+    static const uint64_t MAGIC = GROUP_QUEUE_MAGIC;
+
+    static const char *
+    name()
+    {
+        return "adr-group";
+    }
+};
+
+/*
+ * Group commit through the page cache, e.g. to compare it with PMEM on
+ * the same host. The format is that of AdrGroup, so each one recovers
+ * the queues of the other.
+ */
+struct Msync : AdrGroup {
+    static const bool MSYNC = true;
+
+    static const char *
+    name()
+    {
+        return "msync";
+    }
+};
+
+struct AdrTx : Adr {
+    static const bool TX = true;
+    static const uint64_t MAGIC = TX_QUEUE_MAGIC;
+
+    static const char *
+    name()
+    {
+        return "adr-tx";
+    }
+
+    // Written back on commit.
+    static void
+    persist(const void *, size_t)
+    {}
+
+    static void
+    log(const void *addr, size_t len)
+    {
+        pmemobj_tx_add_range_direct(addr, len);
+    }
+
+    static void
+    tx_begin(PMEMobjpool *pop)
+    {
+        pmemobj_tx_begin(pop, NULL, TX_PARAM_NONE);
+    }
+
+    static void
+    tx_end()
+    {
+        pmemobj_tx_commit();
+        pmemobj_tx_end();
+    }
+};
+
+#endif /* Q_PERSIST_H */
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_PLACEMENT_H
+#define Q_PLACEMENT_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Placement of test threads and volatile queue memory.
+ *
+ * PIN_NONE     leave threads to the scheduler.
+ * PIN_COMPACT  fill one socket after another, producers first.
+ * PIN_SCATTER  spread producers, then consumers, round-robin over sockets.
+ * PIN_SPLIT    producers on the first socket, consumers on the second.
+ *
+ * With PIN_SMT 0 only the first hardware thread of every core is used.
+ * Threads wrap around when there are more of them than CPUs. The
+ * topology is read from sysfs, so no libnuma is needed.
+ * ------------------------------------------------------------------------
+ */
+enum PinPolicy {
+    PIN_NONE,
+    PIN_COMPACT,
+    PIN_SCATTER,
+    PIN_SPLIT
+};
+
+enum ThrRole {
+    PRODUCER,
+    CONSUMER
+};
+
+class Topology {
+public:
+    static const Topology &
+    get()
+    {
+        static const Topology topo;
+        return topo;
+    }
+
+    // CPUs of every socket, sorted by core and hardware thread.
+    const std::vector<std::vector<int>> &
+    sockets() const
+    {
+        return sockets_;
+    }
+
+    // CPUs of a NUMA node.
+    std::vector<int>
+    node_cpus(int node) const
+    {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        return read_list(path);
+    }
+
+private:
+    struct Cpu {
+        int id, socket, core, smt;
+    };
+
+    Topology()
+    {
+        std::vector<Cpu> cpus;
+        for (int id : read_list("/sys/devices/system/cpu/online")) {
+            Cpu c = {id, read_int(id, "physical_package_id"),
+                     read_int(id, "core_id"), 0
+                    };
+            cpus.push_back(c);
+        }
+
+        // Number the hardware threads of every core by CPU id.
+        std::sort(cpus.begin(), cpus.end(), [](const Cpu & a, const Cpu & b) {
+            if (a.socket != b.socket)
+                return a.socket < b.socket;
+            if (a.core != b.core)
+                return a.core < b.core;
+            return a.id < b.id;
+        });
+        for (size_t i = 1; i < cpus.size(); ++i)
+            if (cpus[i].socket == cpus[i - 1].socket &&
+                    cpus[i].core == cpus[i - 1].core)
+                cpus[i].smt = cpus[i - 1].smt + 1;
+
+        int last = -1;
+        for (auto &c : cpus) {
+            if (!PIN_SMT && c.smt)
+                continue;
+            if (c.socket != last) {
+                sockets_.push_back(std::vector<int>());
+                last = c.socket;
+            }
+            sockets_.back().push_back(c.id);
+        }
+        if (sockets_.empty())
+            sockets_.push_back(std::vector<int>(1, 0));
+    }
+
+    static int
+    read_int(int cpu, const char *name)
+    {
+        char path[128];
+        int val = 0;
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            if (fscanf(f, "%d", &val) != 1)
+                val = 0;
+            fclose(f);
+        }
+        return val;
+    }
+
+    // Parse a CPU list such as "0-13,28-41".
+    static std::vector<int>
+    read_list(const char *path)
+    {
+        std::vector<int> list;
+        int a, b;
+        FILE *f = fopen(path, "r");
+        if (!f)
+            return list;
+        while (fscanf(f, "%d", &a) == 1) {
+            b = a;
+            int c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%d", &b) != 1)
+                    break;
+                c = fgetc(f);
+            }
+            for (int i = a; i <= b; ++i)
+                list.push_back(i);
+            if (c != ',')
+                break;
+        }
+        fclose(f);
+        return list;
+    }
+
+    std::vector<std::vector<int>> sockets_;
+};
+
+// Pin the calling thread to one CPU, or to all CPUs of a set.
+static inline void
+pin_to(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        fprintf(stderr, "Error setting thread affinity\n");
+}
+
+/*
+ * CPU of the id'th producer or consumer under PIN_POLICY. Consumers come
+ * after n_producers producers.
+ */
+static inline int
+thr_cpu(ThrRole role, size_t id, size_t n_producers)
+{
+    auto &s = Topology::get().sockets();
+    size_t idx = role == PRODUCER ? id : n_producers + id;
+
+    switch (PIN_POLICY) {
+    case PIN_SCATTER: {
+        auto &cpus = s[idx % s.size()];
+        return cpus[idx / s.size() % cpus.size()];
+    }
+    case PIN_SPLIT: {
+        auto &cpus = s[role == PRODUCER ? 0 : (1 % s.size())];
+        return cpus[id % cpus.size()];
+    }
+    default: {
+        size_t n = 0;
+        for (auto &cpus : s)
+            n += cpus.size();
+        idx %= n;
+        for (auto &cpus : s) {
+            if (idx < cpus.size())
+                return cpus[idx];
+            idx -= cpus.size();
+        }
+        return 0;
+    }
+    }
+}
+
+// Pin a test thread according to PIN_POLICY.
+static inline void
+place_thread(ThrRole role, size_t id, size_t n_producers = NPRODUCERS)
+{
+    if (PIN_POLICY != PIN_NONE && !OVERSUB_CPUS)
+        pin_to(std::vector<int>(1, thr_cpu(role, id, n_producers)));
+}
+
+static inline const char *
+placement_name()
+{
+    static const char *names[] = {"none", "compact", "scatter", "split"};
+    return names[PIN_POLICY];
+}
+
+/*
+ * Touch the pages of a fresh volatile buffer from a thread running on
+ * ARRAY_NODE, so the kernel places them there.
+ */
+static inline void
+first_touch(void *ptr, size_t len)
+{
+    if (ARRAY_NODE < 0)
+        return;
+
+    std::thread thr([ptr, len] {
+        auto cpus = Topology::get().node_cpus(ARRAY_NODE);
+        if (!cpus.empty())
+            pin_to(cpus);
+        ::memset(ptr, 0, len);
+    });
+    thr.join();
+}
+
+#endif /* Q_PLACEMENT_H */
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_PMEM_COPY_H
+#define Q_PMEM_COPY_H
+
+#include <libpmem.h>
+
+#include "config.h"
+
+/*
+ * Copy len bytes to PMEM without draining. The store type depends on the
+ * size rather than on libpmem environment variables: copies of at least
+ * NT_STORE_THRESHOLD bytes use non-temporal stores, smaller ones cached
+ * stores followed by a flush (clwb). Under eADR the caches are persistent,
+ * so small copies skip the flush and rely on the caller's fence.
+ */
+static inline void
+pmem_copy_nodrain(void *dst, const void *src, size_t len, bool eadr = false)
+{
+    unsigned flags = PMEM_F_MEM_NODRAIN;
+
+    if (len >= NT_STORE_THRESHOLD)
+        flags |= PMEM_F_MEM_NONTEMPORAL;
+    else if (eadr)
+        flags |= PMEM_F_MEM_TEMPORAL | PMEM_F_MEM_NOFLUSH;
+    else
+        flags |= PMEM_F_MEM_TEMPORAL;
+    pmem_memcpy(dst, src, len, flags);
+}
+
+#endif /* Q_PMEM_COPY_H */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_POOL_DIR_H
+#define Q_POOL_DIR_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpmem.h>
+
+/*
+ * ------------------------------------------------------------------------
+ * Pool directory: many named persistent structures in one PMEM file.
+ *
+ * The file starts with a superblock holding a fixed-size directory. Each
+ * entry names a region of the file and records the magic and geometry of
+ * the structure living there, so a mismatching program cannot attach to
+ * it. Regions are carved off the end of the previous one. A region that
+ * is put back keeps its place and is handed out again for the next name
+ * asking for the same size. An entry is written and persisted first and
+ * only then committed by bumping n_entries or, for a reused one, by
+ * writing its name, so a crash leaves at most an unused region behind.
+ *
+ * A pool on a file that is not PMEM, e.g. on an SSD, persists its own
+ * metadata with msync(); its users check is_pmem to do the same.
+ *
+ * The format is shared with linkedlist/include/pool_dir.h, so queues and
+ * lists can live in the same pool file. Keep both copies in sync.
+ * ------------------------------------------------------------------------
+ */
+
+#define POOL_DIR_MAGIC    0x4E4F6350
+#define POOL_DIR_ENTRIES  1024
+#define POOL_NAME_LEN     48
+#define POOL_GEOM_LEN     4
+#define POOL_ALIGN        4096 /* Region alignment */
+
+typedef struct pool_entry {
+    char name[POOL_NAME_LEN];
+    uint64_t magic;               /* Magic of the hosted structure */
+    uint64_t off;                 /* Region offset from the pool start */
+    uint64_t size;                /* Region size in bytes */
+    uint64_t geom[POOL_GEOM_LEN]; /* Geometry it was created with */
+    uint64_t pad[3];
+} pool_entry_t;
+
+typedef struct pool_super {
+    uint64_t magic;
+    uint64_t size;                /* Pool file size */
+    uint64_t n_entries;           /* Committed directory entries */
+    uint64_t pad[5];
+    pool_entry_t entry[POOL_DIR_ENTRIES];
+} pool_super_t;
+
+/* Volatile handle of an open pool. */
+typedef struct pool_dir {
+    pool_super_t *sb;
+    size_t size;
+    int is_pmem;                  /* Mapped PMEM, no msync() needed */
+    pthread_mutex_t lock;
+} pool_dir_t;
+
+/* Offset of the first region. */
+#define POOL_DATA_OFF \
+	(((sizeof(pool_super_t) + POOL_ALIGN - 1) / POOL_ALIGN) * POOL_ALIGN)
+
+/* Make a range of the pool durable, with msync() if it is not PMEM. */
+static inline void
+pool_persist(const pool_dir_t *pool, const void *addr, size_t len)
+{
+    if (pool->is_pmem)
+        pmem_persist(addr, len);
+    else
+        pmem_msync(addr, len);
+}
+
+/*
+ * Map the pool file at path, creating a size-byte pool if there is none.
+ * An existing pool keeps its size.
+ */
+static inline pool_dir_t *
+pool_dir_open(const char *path, size_t size)
+{
+    size_t mapped;
+    int is_pmem;
+    pool_super_t *sb;
+    pool_dir_t *pool;
+
+    sb = (pool_super_t *)pmem_map_file(path, 0, 0, 0, &mapped, &is_pmem);
+    if (!sb)
+        sb = (pool_super_t *)pmem_map_file(path, size, PMEM_FILE_CREATE,
+                                           0666, &mapped, &is_pmem);
+    if (!sb)
+        return NULL;
+
+    pool = (pool_dir_t *)malloc(sizeof(pool_dir_t));
+    pool->sb = sb;
+    pool->size = mapped;
+    pool->is_pmem = is_pmem;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    if (sb->magic != POOL_DIR_MAGIC) {
+        sb->size = mapped;
+        sb->n_entries = 0;
+        pool_persist(pool, sb, sizeof(*sb));
+        sb->magic = POOL_DIR_MAGIC;
+        pool_persist(pool, &sb->magic, sizeof(sb->magic));
+    }
+    return pool;
+}
+
+/* Unmap the pool. Regions handed out before become invalid. */
+static inline void
+pool_dir_close(pool_dir_t *pool)
+{
+    pmem_unmap(pool->sb, pool->size);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/*
+ * Return the region called name, creating one of size bytes if there is
+ * none. The hosted structure keeps its own magic inside the region to
+ * tell a fresh region from an initialized one. Returns NULL if the
+ * existing region was created with a different magic, size or geometry,
+ * or if the pool is full.
+ */
+static inline void *
+pool_dir_get(pool_dir_t *pool, const char *name, uint64_t magic,
+             const uint64_t geom[POOL_GEOM_LEN], size_t size)
+{
+    pool_super_t *sb = pool->sb;
+    pool_entry_t *e, *reuse = NULL;
+    uint64_t i, off = POOL_DATA_OFF;
+    void *ptr = NULL;
+
+    if (!name[0] || strlen(name) >= POOL_NAME_LEN)
+        return NULL;
+    size = ((size + POOL_ALIGN - 1) / POOL_ALIGN) * POOL_ALIGN;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < sb->n_entries; ++i) {
+        e = &sb->entry[i];
+        if (!e->name[0] && e->size == size && !reuse)
+            reuse = e;
+        if (strncmp(e->name, name, POOL_NAME_LEN) == 0) {
+            if (e->magic == magic && e->size == size &&
+                    memcmp(e->geom, geom, sizeof(e->geom)) == 0)
+                ptr = (char *)sb + e->off;
+            else
+                fprintf(stderr, "pool: %s has a different layout\n", name);
+            goto out;
+        }
+        off = e->off + e->size;
+    }
+
+    if (reuse) {
+        /*
+         * Hosted structures keep their magic in the first page, zero it
+         * so the new owner finds a fresh region.
+         */
+        ptr = (char *)sb + reuse->off;
+        memset(ptr, 0, POOL_ALIGN);
+        pool_persist(pool, ptr, POOL_ALIGN);
+        reuse->magic = magic;
+        memcpy(reuse->geom, geom, sizeof(reuse->geom));
+        pool_persist(pool, reuse, sizeof(*reuse));
+        strncpy(reuse->name, name, POOL_NAME_LEN - 1);
+        pool_persist(pool, reuse->name, sizeof(reuse->name));
+        goto out;
+    }
+
+    if (i == POOL_DIR_ENTRIES || off + size > pool->size) {
+        fprintf(stderr, "pool: no space left for %s\n", name);
+        goto out;
+    }
+
+    e = &sb->entry[i];
+    memset(e, 0, sizeof(*e));
+    strncpy(e->name, name, POOL_NAME_LEN - 1);
+    e->magic = magic;
+    e->off = off;
+    e->size = size;
+    memcpy(e->geom, geom, sizeof(e->geom));
+    pool_persist(pool, e, sizeof(*e));
+
+    sb->n_entries = i + 1;
+    pool_persist(pool, &sb->n_entries, sizeof(sb->n_entries));
+    ptr = (char *)sb + off;
+out:
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+/*
+ * Give the region called name back to the pool. Its memory is handed out
+ * again by pool_dir_get() and must not be used any more. Returns -1 if
+ * there is no such region.
+ */
+static inline int
+pool_dir_put(pool_dir_t *pool, const char *name)
+{
+    pool_super_t *sb = pool->sb;
+    pool_entry_t *e;
+    uint64_t i;
+    int ret = -1;
+
+    if (!name[0])
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < sb->n_entries; ++i) {
+        e = &sb->entry[i];
+        if (strncmp(e->name, name, POOL_NAME_LEN) == 0) {
+            e->name[0] = 0;
+            pool_persist(pool, e->name, 1);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+#endif /* Q_POOL_DIR_H */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_RECOVERY_H
+#define Q_RECOVERY_H
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "timer.h"
+
+/*
+ * Split [0, n) into up to RECOVERY_THREADS slices of at least min_slice
+ * and call f(begin, end) for each. The calling thread takes the first
+ * slice, so small ranges never start a thread.
+ */
+template<class F>
+void
+parallel_for(unsigned long n, unsigned long min_slice, F f)
+{
+    unsigned long n_thr = std::max(1UL, n / std::max(1UL, min_slice));
+    n_thr = std::min(n_thr, (unsigned long)RECOVERY_THREADS);
+    unsigned long slice = (n + n_thr - 1) / n_thr;
+
+    std::vector<std::thread> thr;
+    for (unsigned long b = slice; b < n; b += slice)
+        thr.emplace_back(f, b, std::min(n, b + slice));
+    f(0UL, std::min(n, slice));
+    for (auto &t : thr)
+        t.join();
+}
+
+// Wall-clock time of consecutive recovery phases.
+class PhaseTimer {
+public:
+    PhaseTimer()
+        : start_(get_timestamp()),
+          last_(start_)
+    {}
+
+    // Print the time since the previous phase ended.
+    void
+    phase(const char *name)
+    {
+        double now = get_timestamp();
+        print(name, now - last_);
+        last_ = now;
+    }
+
+    ~PhaseTimer()
+    {
+        print("total", get_timestamp() - start_);
+    }
+
+private:
+    static void
+    print(const char *name, double us)
+    {
+        std::cout << "recovery " << name << " took " << std::fixed
+                  << std::setprecision(3) << us / 1000 << "ms"
+                  << std::endl;
+    }
+
+    double start_, last_;
+};
+
+#endif /* Q_RECOVERY_H */
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_SEGMENTED_H
+#define Q_SEGMENTED_H
+
+#include <sched.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "wait.h"
+#include "pool_dir.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Segmented unbounded queue.
+ *
+ * A chain of fixed-size persistent rings, each a region of a pool
+ * directory called <name>.<seq>. Producers push to the last segment and
+ * consumers pop from the first one, lock-free. A producer finding the
+ * last segment full seals it and appends a new one; a consumer finding
+ * a sealed segment drained moves on to the next and puts the old region
+ * back into the pool, so PMEM use follows the backlog rather than the
+ * worst case. Only these two rare steps take a lock.
+ *
+ * The chain is persisted as the range [first, last] of sequence numbers
+ * in a header region called <name>: a new segment is linked after it is
+ * initialized, a drained one is unlinked before its region is freed.
+ * Recovery reopens every linked segment, which recovers on its own.
+ * The pool must have room for the segments of the largest backlog.
+ *
+ * FIFO order holds per producer. Batches do not span segments, so every
+ * push_n() must push a multiple of the n pop_n() is called with.
+ * ------------------------------------------------------------------------
+ */
+template<class Q, class T>
+class SegmentedQueue {
+private:
+    struct Header {
+        uint64_t magic;
+        // Sequence numbers of the first and the last linked segment.
+        uint64_t first;
+        uint64_t last;
+    };
+
+    /*
+     * Volatile handle of a segment. Handles are recycled but never
+     * freed, so a thread holding a stale pointer may still touch its
+     * counters; it then finds that the handle is no longer the head or
+     * tail and starts over.
+     */
+    struct Segment {
+        std::unique_ptr<Q>      q;
+        uint64_t                seq;
+        Segment                 *next;
+        // No push enters the segment once it is set.
+        std::atomic<bool>       sealed;
+        // Threads inside q.
+        std::atomic<long>       pushers, poppers;
+    };
+
+    std::string
+    seg_name(uint64_t seq) const
+    {
+        return name_ + "." + std::to_string(seq);
+    }
+
+    // Open segment seq, creating it if needed. Called with lock_ held.
+    Segment *
+    open_segment(uint64_t seq)
+    {
+        std::string name = seg_name(seq);
+        Segment *s;
+        if (spare_.empty()) {
+            all_.emplace_back(new Segment);
+            s = all_.back().get();
+            s->pushers.store(0);
+            s->poppers.store(0);
+        } else {
+            s = spare_.back();
+            spare_.pop_back();
+        }
+        s->q.reset(new Q(pool_, name.c_str(), n_producers_, n_consumers_));
+        s->seq = seq;
+        s->next = NULL;
+        s->sealed.store(false);
+        ++n_segments_;
+        return s;
+    }
+
+    // Append a segment after the full tail s, unless another producer did.
+    void
+    grow(Segment *s)
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        if (tail_.load() != s)
+            return;
+
+        Segment *t = open_segment(s->seq + 1);
+        hdr_->last = t->seq;
+        pmem_persist(&hdr_->last, sizeof(hdr_->last));
+
+        s->next = t;
+        s->sealed.store(true);
+        tail_.store(t);
+        max_segments_ = std::max(max_segments_, n_segments_);
+    }
+
+    // Unlink the drained head s and give its region back.
+    void
+    retire(Segment *s)
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        if (head_.load() != s)
+            return;
+
+        hdr_->first = s->next->seq;
+        pmem_persist(&hdr_->first, sizeof(hdr_->first));
+        head_.store(s->next);
+
+        // Let pops that found s the head finish.
+        while (s->poppers.load())
+            sched_yield();
+        s->q.reset();
+        pool_dir_put(pool_, seg_name(s->seq).c_str());
+        spare_.push_back(s);
+        --n_segments_;
+    }
+
+    // Reopen the linked segments or start the chain.
+    void
+    recover()
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        if (hdr_->magic != SEG_QUEUE_MAGIC) {
+            hdr_->first = hdr_->last = 0;
+            pmem_persist(hdr_, sizeof(*hdr_));
+            hdr_->magic = SEG_QUEUE_MAGIC;
+            pmem_persist(&hdr_->magic, sizeof(hdr_->magic));
+        }
+
+        // A crash may have left a region unlinked on either end.
+        if (hdr_->first)
+            pool_dir_put(pool_, seg_name(hdr_->first - 1).c_str());
+        pool_dir_put(pool_, seg_name(hdr_->last + 1).c_str());
+
+        Segment *prev = NULL;
+        for (uint64_t seq = hdr_->first; seq <= hdr_->last; ++seq) {
+            Segment *s = open_segment(seq);
+            if (prev) {
+                prev->next = s;
+                prev->sealed.store(true);
+            } else {
+                head_.store(s);
+            }
+            prev = s;
+        }
+        tail_.store(prev);
+        max_segments_ = n_segments_;
+    }
+
+public:
+    // Open or create the queue called name in a pool directory.
+    SegmentedQueue(pool_dir_t *pool, const char *name, size_t n_producers,
+                   size_t n_consumers)
+        : pool_(pool),
+          name_(name),
+          n_producers_(n_producers),
+          n_consumers_(n_consumers),
+          n_segments_(0),
+          max_segments_(0)
+    {
+        uint64_t geom[POOL_GEOM_LEN] = {sizeof(T), n_producers,
+                                        n_consumers, 0
+                                       };
+        hdr_ = (Header *)pool_dir_get(pool, name, SEG_QUEUE_MAGIC, geom,
+                                      sizeof(Header));
+        assert(hdr_);
+        recover();
+    }
+
+    void
+    push(T *ptr)
+    {
+        push_n(ptr, 1);
+    }
+
+    // Push n items to the last segment, appending one if it is full.
+    void
+    push_n(T *ptr, size_t n)
+    {
+        while (true) {
+            Segment *s = tail_.load();
+            s->pushers.fetch_add(1);
+            if (UNLIKELY(s != tail_.load() || s->sealed.load())) {
+                s->pushers.fetch_sub(1);
+                continue;
+            }
+            bool ok = s->q->try_push_n(ptr, n);
+            s->pushers.fetch_sub(1);
+            if (LIKELY(ok)) {
+                ev_.notify();
+                return;
+            }
+            grow(s);
+        }
+    }
+
+    // Never fails, the queue is unbounded.
+    bool
+    try_push(T *ptr)
+    {
+        return try_push_n(ptr, 1);
+    }
+
+    bool
+    try_push_n(T *ptr, size_t n)
+    {
+        push_n(ptr, n);
+        return true;
+    }
+
+    void
+    pop(T *ptr)
+    {
+        pop_n(ptr, 1);
+    }
+
+    // Pop n items, waiting while the queue is empty.
+    void
+    pop_n(T *ptr, size_t n)
+    {
+        ev_.wait_until([&] {
+            return try_pop_n(ptr, n);
+        });
+    }
+
+    bool
+    try_pop(T *ptr)
+    {
+        return try_pop_n(ptr, 1);
+    }
+
+    /*
+     * Pop n items from the first segment, moving on to the next one when
+     * it is sealed and drained.
+     * @return false if the queue is empty.
+     */
+    bool
+    try_pop_n(T *ptr, size_t n)
+    {
+        while (true) {
+            Segment *s = head_.load();
+            s->poppers.fetch_add(1);
+            if (UNLIKELY(s != head_.load())) {
+                s->poppers.fetch_sub(1);
+                continue;
+            }
+            bool ok = s->q->try_pop_n(ptr, n);
+            /*
+             * Pushes to a sealed segment that are done are visible, so
+             * the segment is drained for good if they found it so.
+             */
+            bool drained = !ok && s->sealed.load() &&
+                           !s->pushers.load() && s->q->drained();
+            s->poppers.fetch_sub(1);
+            if (LIKELY(ok))
+                return true;
+            if (!drained)
+                return false;
+            retire(s);
+        }
+    }
+
+    // Linked segments.
+    size_t
+    segments() const
+    {
+        return n_segments_;
+    }
+
+    // Most segments linked at once since the queue was opened.
+    size_t
+    max_segments() const
+    {
+        return max_segments_;
+    }
+
+private:
+    pool_dir_t                              *pool_;
+    const std::string                       name_;
+    const size_t                            n_producers_, n_consumers_;
+    Header                                  *hdr_;
+    std::atomic<Segment *>                  head_, tail_;
+    // Serializes grow(), retire() and the bookkeeping below.
+    std::mutex                              lock_;
+    std::vector<std::unique_ptr<Segment>>   all_;
+    std::vector<Segment *>                  spare_;
+    size_t                                  n_segments_, max_segments_;
+    // Sleeping consumers wait for a push.
+    WaitEvent                               ev_;
+};
+
+#endif /* Q_SEGMENTED_H */
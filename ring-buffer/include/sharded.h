@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_SHARDED_H
+#define Q_SHARDED_H
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "wait.h"
+#include "pool_dir.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * NUMA-sharded queue.
+ *
+ * Holds one persistent ring per NUMA node, each in a pool directory on
+ * that node's DAX mount (PMEM_NODE_PATHS), so head_/tail_ updates and
+ * slot stores stay on the local socket. Producers push to the shard of
+ * their node. Consumers pop from the local shard first and steal from
+ * the other shards, in node order, only when the local one is empty.
+ *
+ * A thread's node is looked up once, on its first operation, so threads
+ * should not move between nodes (numactl --cpunodebind or pinning).
+ * FIFO order only holds within a shard.
+ * ------------------------------------------------------------------------
+ */
+template<class Q, class T>
+class ShardedQueue {
+public:
+    ShardedQueue(size_t n_producers, size_t n_consumers)
+        : steals_(0)
+    {
+        static const char *paths[NUMA_NODES] = PMEM_NODE_PATHS;
+
+        for (size_t i = 0; i < NUMA_NODES; ++i) {
+            std::string path = std::string(paths[i]) + "/pool";
+            pool_dir_t *pool = pool_dir_open(path.c_str(), POOL_SIZE);
+            assert(pool);
+            pools_.push_back(pool);
+
+            std::string name = "shard" + std::to_string(i);
+            shards_.emplace_back(new Q(pool, name.c_str(), n_producers,
+                                       n_consumers));
+        }
+    }
+
+    ~ShardedQueue()
+    {
+        shards_.clear();
+        for (auto pool : pools_)
+            pool_dir_close(pool);
+    }
+
+    void
+    push(T *ptr)
+    {
+        push_n(ptr, 1);
+    }
+
+    // Push n items to the local shard, waiting while it is full.
+    void
+    push_n(T *ptr, size_t n)
+    {
+        shards_[node()]->push_n(ptr, n);
+        ev_.notify();
+    }
+
+    bool
+    try_push(T *ptr)
+    {
+        return try_push_n(ptr, 1);
+    }
+
+    /*
+     * Push n items to the local shard.
+     * @return false if it has no room for them.
+     */
+    bool
+    try_push_n(T *ptr, size_t n)
+    {
+        if (!shards_[node()]->try_push_n(ptr, n))
+            return false;
+        ev_.notify();
+        return true;
+    }
+
+    void
+    pop(T *ptr)
+    {
+        pop_n(ptr, 1);
+    }
+
+    // Pop n items from one shard, waiting while all of them are empty.
+    void
+    pop_n(T *ptr, size_t n)
+    {
+        ev_.wait_until([&] {
+            return try_pop_n(ptr, n);
+        });
+    }
+
+    bool
+    try_pop(T *ptr)
+    {
+        return try_pop_n(ptr, 1);
+    }
+
+    /*
+     * Pop n items from the local shard or, if it is empty, from the first
+     * remote shard that holds them.
+     * @return false if no shard does.
+     */
+    bool
+    try_pop_n(T *ptr, size_t n)
+    {
+        size_t local = node();
+
+        if (shards_[local]->try_pop_n(ptr, n))
+            return true;
+        for (size_t i = 1; i < shards_.size(); ++i) {
+            if (shards_[(local + i) % shards_.size()]->try_pop_n(ptr, n)) {
+                steals_.fetch_add(n, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Items consumers took from remote shards.
+    unsigned long
+    steals() const
+    {
+        return steals_.load();
+    }
+
+private:
+    // Shard of the calling thread.
+    size_t
+    node() const
+    {
+        static thread_local int node = -1;
+
+        if (UNLIKELY(node < 0)) {
+            unsigned cpu, n;
+            if (syscall(SYS_getcpu, &cpu, &n, NULL))
+                n = 0;
+            node = n;
+        }
+        return node % shards_.size();
+    }
+
+    std::vector<pool_dir_t *>       pools_;
+    std::vector<std::unique_ptr<Q>> shards_;
+    // Sleeping consumers wait for a push to any shard.
+    WaitEvent                       ev_;
+    std::atomic<unsigned long>      steals_;
+};
+
+#endif /* Q_SHARDED_H */
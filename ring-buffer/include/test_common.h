@@ -12,12 +12,27 @@
 #ifndef Q_TEST_COMMON_H
 #define Q_TEST_COMMON_H
 
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
 #include <atomic>
 #include <cassert>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "config.h"
+#include "timer.h"
+#include "pool_dir.h"
+#include "placement.h"
+#include "histogram.h"
 
 static size_t __thread __thr_id;
 
@@ -44,6 +59,15 @@ set_thr_id(size_t id)
 static const auto N = QUEUE_SIZE * 32;
 static const auto CONSUMERS = NCONSUMERS;
 static const auto PRODUCERS = NPRODUCERS;
+static const auto BATCH = BATCH_SIZE;
+
+static_assert(N % BATCH == 0, "BATCH_SIZE must divide the item count");
+#ifdef ZERO_COPY
+static_assert(BATCH == 1, "ZERO_COPY tests move one item at a time");
+#ifdef TRY_OPS
+#error "ZERO_COPY and TRY_OPS are mutually exclusive"
+#endif
+#endif
 
 struct data {
     char d_[SLOT_SIZE];
@@ -56,9 +80,9 @@ static const char X_EMPTY = 0; // the address skipped by producers
 static const char X_MISSED = 255; // the address skipped by consumers
 q_type x[N * PRODUCERS];
 #else
-q_type x[PRODUCERS];
+q_type x[PRODUCERS * BATCH];
 #endif
-q_type y[CONSUMERS];
+q_type y[CONSUMERS * BATCH];
 std::atomic<int> n(0);
 
 template<class Q>
@@ -78,19 +102,41 @@ struct Producer : public Worker<Q> {
         : Worker<Q>(q, id)
     {}
 
+    // Push BATCH items starting at v.
+    void put(q_type *v)
+    {
+#ifdef ZERO_COPY
+        // Build the item directly in the queue slot.
+        q_type *s = Worker<Q>::q_->reserve();
+        memcpy(s, v, sizeof(q_type));
+        Worker<Q>::q_->commit();
+#elif defined(TRY_OPS)
+        // Let consumers run while the queue is full.
+        while (!Worker<Q>::q_->try_push_n(v, BATCH))
+            std::this_thread::yield();
+#else
+        if (BATCH > 1)
+            Worker<Q>::q_->push_n(v, BATCH);
+        else
+            Worker<Q>::q_->push(v);
+#endif
+    }
+
     void operator()()
     {
         set_thr_id(Worker<Q>::thr_id_);
 
 #ifdef CHECK_DATA
-        for (auto i = thr_id(); i < N * PRODUCERS; i += PRODUCERS) {
-            x[i].d_[0] = X_MISSED;
-            Worker<Q>::q_->push(x + i);
+        for (auto i = thr_id() * BATCH; i < N * PRODUCERS;
+             i += PRODUCERS * BATCH) {
+            for (auto j = 0; j < BATCH; ++j)
+                x[i + j].d_[0] = X_MISSED;
+            put(x + i);
         }
 #else
         auto id = thr_id();
-        for (auto i = 0; i < N; ++i) {
-            Worker<Q>::q_->push(x + id);
+        for (auto i = 0; i < N; i += BATCH) {
+            put(x + id * BATCH);
         }
 #endif
     }
@@ -106,14 +152,81 @@ struct Consumer : public Worker<Q> {
     {
         set_thr_id(Worker<Q>::thr_id_);
 
-        while (n.fetch_add(1) < N * PRODUCERS) {
-            q_type *v = y + thr_id();
-            Worker<Q>::q_->pop(v);
+        while (n.fetch_add(BATCH) < N * PRODUCERS) {
+#ifdef ZERO_COPY
+            // Parse the item in place.
+            const q_type *v = Worker<Q>::q_->borrow();
             assert(v);
 #ifdef CHECK_DATA
             assert(v->d_[0] == X_MISSED);
-            v->d_[0] = (char)(thr_id() + 1); // don't write zero
 #endif
+            Worker<Q>::q_->release();
+#else
+            q_type *v = y + thr_id() * BATCH;
+#ifdef TRY_OPS
+            while (!Worker<Q>::q_->try_pop_n(v, BATCH))
+                std::this_thread::yield();
+#else
+            if (BATCH > 1)
+                Worker<Q>::q_->pop_n(v, BATCH);
+            else
+                Worker<Q>::q_->pop(v);
+#endif
+            assert(v);
+#ifdef CHECK_DATA
+            for (auto j = 0; j < BATCH; ++j) {
+                assert(v[j].d_[0] == X_MISSED);
+                v[j].d_[0] = (char)(thr_id() + 1); // don't write zero
+            }
+#endif
+#endif
+        }
+    }
+};
+
+/*
+ * Payload length of the i'th record in variable-length record tests,
+ * spread over [MIN_RECORD_SIZE, MAX_RECORD_SIZE].
+ */
+static inline size_t
+rec_len(size_t i)
+{
+    return MIN_RECORD_SIZE +
+           (i * 2654435761UL) % (MAX_RECORD_SIZE - MIN_RECORD_SIZE + 1);
+}
+
+template<class Q>
+struct VarProducer : public Worker<Q> {
+    VarProducer(Q *q, size_t id)
+        : Worker<Q>(q, id)
+    {}
+
+    void operator()()
+    {
+        set_thr_id(Worker<Q>::thr_id_);
+
+        auto id = thr_id();
+        for (auto i = 0; i < N; ++i) {
+            Worker<Q>::q_->push(x + id, rec_len(i));
+        }
+    }
+};
+
+template<class Q>
+struct VarConsumer : public Worker<Q> {
+    VarConsumer(Q *q, size_t id)
+        : Worker<Q>(q, id)
+    {}
+
+    void operator()()
+    {
+        set_thr_id(Worker<Q>::thr_id_);
+
+        while (n.fetch_add(1) < N * PRODUCERS) {
+            q_type *v = y + thr_id();
+            auto len = Worker<Q>::q_->pop(v, sizeof(q_type));
+            assert(len >= MIN_RECORD_SIZE && len <= MAX_RECORD_SIZE);
+            (void)len;
         }
     }
 };
@@ -124,7 +237,39 @@ tv_to_ms(const struct timeval &tv)
     return ((unsigned long)tv.tv_sec * 1000000 + tv.tv_usec) / 1000;
 }
 
-template<class Q>
+// User plus system CPU time of the process in ms.
+static inline unsigned long
+cpu_time_ms()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return tv_to_ms(ru.ru_utime) + tv_to_ms(ru.ru_stime);
+}
+
+/*
+ * Run all test threads on the first OVERSUB_CPUS CPUs, so there are more
+ * threads than cores and waiting threads compete with working ones.
+ */
+static inline void
+oversubscribe()
+{
+    if (!OVERSUB_CPUS)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto i = 0; i < OVERSUB_CPUS; ++i)
+        CPU_SET(i, &set);
+    // Threads inherit the affinity of the main thread.
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        perror("sched_setaffinity");
+        return;
+    }
+    std::cout << PRODUCERS + CONSUMERS << " threads on " << OVERSUB_CPUS
+              << " CPUs" << std::endl;
+}
+
+template<class Q, class P = Producer<Q>, class C = Consumer<Q>>
 void
 run_test(Q &&q)
 {
@@ -135,12 +280,21 @@ run_test(Q &&q)
     ::memset(x, X_EMPTY, N * sizeof(q_type) * PRODUCERS);
 #endif
 
+    oversubscribe();
+    if (PIN_POLICY != PIN_NONE)
+        std::cout << "Placement: " << placement_name() << ", SMT "
+                  << (PIN_SMT ? "on" : "off") << std::endl;
+
     struct timeval tv0, tv1;
+    auto cpu0 = cpu_time_ms();
     gettimeofday(&tv0, NULL);
 
     // Run producers.
     for (auto i = 0; i < PRODUCERS; ++i)
-        thr[i] = std::thread(Producer<Q>(&q, i));
+        thr[i] = std::thread([&q, i] {
+        place_thread(PRODUCER, i);
+        P(&q, i)();
+    });
 
     ::usleep(10 * 1000); // sleep to wait until the queue is full
 
@@ -151,15 +305,19 @@ run_test(Q &&q)
      * so we care only about different IDs for threads of the same type.
      */
     for (auto i = 0; i < CONSUMERS; ++i)
-        thr[PRODUCERS + i] = std::thread(Consumer<Q>(&q, i));
+        thr[PRODUCERS + i] = std::thread([&q, i] {
+        place_thread(CONSUMER, i);
+        C(&q, i)();
+    });
 
     // Wait for all threads completion.
     for (auto i = 0; i < PRODUCERS + CONSUMERS; ++i)
         thr[i].join();
 
     gettimeofday(&tv1, NULL);
-    std::cout << "Test took " << (tv_to_ms(tv1) - tv_to_ms(tv0)) << "ms"
-              << std::endl;
+    std::cout << "Test took " << (tv_to_ms(tv1) - tv_to_ms(tv0)) << "ms, "
+              << (cpu_time_ms() - cpu0) << "ms CPU" << std::endl;
+    lat_report();
 
 #ifdef CHECK_DATA
     // Check data.
@@ -180,4 +338,568 @@ run_test(Q &&q)
 #endif
 }
 
+/*
+ * Run producers and consumers on the persistent queue q without end and
+ * exit abruptly after ms milliseconds, leaving a crashed pool behind.
+ */
+template<class Q>
+void
+crash_test(Q &q, unsigned long ms)
+{
+    std::thread thr[PRODUCERS + CONSUMERS];
+
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        thr[i] = std::thread([&q, i] {
+        place_thread(PRODUCER, i);
+        set_thr_id(i);
+        while (true)
+            q.push(x + i * BATCH);
+    });
+
+    ::usleep(10 * 1000); // sleep to wait until the queue is full
+
+    for (size_t i = 0; i < CONSUMERS; ++i)
+        thr[PRODUCERS + i] = std::thread([&q, i] {
+        place_thread(CONSUMER, i);
+        set_thr_id(i);
+        while (true)
+            q.pop(y + i * BATCH);
+    });
+
+    ::usleep(ms * 1000);
+    std::cout << "Crashing after " << ms << "ms" << std::endl;
+    _exit(0);
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Crash injection tests, see crash.h and scripts/crash_inject.sh.
+ *
+ * crash_run() stamps every item with its producer and a per-producer
+ * sequence number and records in a log file next to the queue which
+ * items were acknowledged (their push was durable) and which were popped.
+ * The file is shared memory, so the records outlive a SIGKILL. After the
+ * crash crash_check() drains the recovered queue and checks that every
+ * acknowledged item was popped or drained exactly once.
+ *
+ * A SIGKILL loses no stores, so the test covers the recovery logic for
+ * every in-flight state, not missing flushes.
+ * ------------------------------------------------------------------------
+ */
+static_assert(SLOT_SIZE >= 2 * sizeof(unsigned long),
+              "crash tests stamp both ends of an item");
+
+static const unsigned long CRASH_ACK_BATCH = 8; // pop_pending() per ack()
+
+struct CrashLog {
+    unsigned long acked[PRODUCERS];  // Items whose push returned
+    unsigned long in_pop[CONSUMERS]; // Popped items may be unrecorded
+    unsigned long torn;              // Items with a damaged stamp
+    unsigned long dups;              // Items popped more than once
+    unsigned char seen[PRODUCERS][N];
+};
+
+static CrashLog *
+crash_log_open(bool create)
+{
+    size_t len;
+    void *ptr;
+
+    if (create)
+        ptr = pmem_map_file(PMEM_DAXFS_PATH "/crash_log", sizeof(CrashLog),
+                            PMEM_FILE_CREATE, 0666, &len, NULL);
+    else
+        ptr = pmem_map_file(PMEM_DAXFS_PATH "/crash_log", 0, 0, 0, &len,
+                            NULL);
+    if (!ptr || len < sizeof(CrashLog)) {
+        std::cout << "Cannot map the crash log" << std::endl;
+        return NULL;
+    }
+    if (create)
+        ::memset(ptr, 0, sizeof(CrashLog));
+    return (CrashLog *)ptr;
+}
+
+static inline void
+crash_stamp(q_type *v, size_t id, unsigned long seq)
+{
+    unsigned long tag = (id << 48) | seq;
+    ::memcpy(v->d_, &tag, sizeof(tag));
+    ::memcpy(v->d_ + SLOT_SIZE - sizeof(tag), &tag, sizeof(tag));
+}
+
+// Mark the popped item v as seen and count damaged and duplicate ones.
+static inline void
+crash_record(CrashLog *log, const q_type *v)
+{
+    unsigned long tag, end;
+    ::memcpy(&tag, v->d_, sizeof(tag));
+    ::memcpy(&end, v->d_ + SLOT_SIZE - sizeof(end), sizeof(end));
+
+    size_t id = tag >> 48;
+    unsigned long seq = tag & ((1UL << 48) - 1);
+    if (tag != end || id >= PRODUCERS || seq >= N)
+        __sync_fetch_and_add(&log->torn, 1);
+    else if (__atomic_exchange_n(&log->seen[id][seq], 1, __ATOMIC_SEQ_CST))
+        __sync_fetch_and_add(&log->dups, 1);
+}
+
+/*
+ * Push and pop stamped items until all of them went through or a crash
+ * point kills the process. With pending, consumers use pop_pending() and
+ * ack every CRASH_ACK_BATCH pops, or when they run dry, after recording
+ * the items, so a crash may redeliver items but never loses one.
+ */
+template<class Q>
+void
+crash_run(Q &q, bool pending = false)
+{
+    std::thread thr[PRODUCERS + CONSUMERS];
+    CrashLog *log = crash_log_open(true);
+    assert(log);
+
+    n.store(0);
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        thr[i] = std::thread([&q, log, i] {
+        place_thread(PRODUCER, i);
+        set_thr_id(i);
+        q_type v[BATCH];
+        for (unsigned long seq = 0; seq < N; seq += BATCH) {
+            for (auto j = 0; j < BATCH; ++j)
+                crash_stamp(&v[j], i, seq + j);
+            q.wait_durable(q.push_atomic(v, BATCH));
+            __atomic_store_n(&log->acked[i], seq + BATCH, __ATOMIC_RELEASE);
+        }
+    });
+
+    for (size_t i = 0; i < CONSUMERS; ++i)
+        thr[PRODUCERS + i] = std::thread([&q, log, i, pending] {
+        place_thread(CONSUMER, i);
+        set_thr_id(i);
+        q_type v[BATCH];
+        unsigned long k = 0, pos = 0;
+        while (n.fetch_add(BATCH) < N * PRODUCERS) {
+            if (pending) {
+                // Ack what we have before waiting for more.
+                if (!q.try_pop_pending_n(v, BATCH, &pos)) {
+                    if (k % CRASH_ACK_BATCH)
+                        q.ack(pos);
+                    k = 0;
+                    pos = q.pop_pending_n(v, BATCH);
+                }
+                for (auto j = 0; j < BATCH; ++j)
+                    crash_record(log, &v[j]);
+                if (++k % CRASH_ACK_BATCH == 0)
+                    q.ack(pos);
+                continue;
+            }
+            __atomic_store_n(&log->in_pop[i], 1, __ATOMIC_SEQ_CST);
+            q.pop_n(v, BATCH);
+            for (auto j = 0; j < BATCH; ++j)
+                crash_record(log, &v[j]);
+            __atomic_store_n(&log->in_pop[i], 0, __ATOMIC_RELEASE);
+        }
+        if (k % CRASH_ACK_BATCH)
+            q.ack(pos);
+    });
+
+    for (auto i = 0; i < PRODUCERS + CONSUMERS; ++i)
+        thr[i].join();
+    std::cout << "All items went through without a crash" << std::endl;
+}
+
+/*
+ * Drain the queue q, recovered after crash_run(), and check the items.
+ * Acknowledged items may only be missing if a consumer was killed between
+ * popping and recording them. Of the items in flight at the crash, only
+ * the last BATCH of every producer may show up, and only as a whole, see
+ * push_atomic(). With redeliver, items may be popped again, as group
+ * commit does with pops that were not durable.
+ * @return true if nothing was lost, duplicated, split or damaged.
+ */
+template<class Q>
+bool
+crash_check(Q &q, bool redeliver = false)
+{
+    CrashLog *log = crash_log_open(false);
+    if (!log)
+        return false;
+
+    set_thr_id(0);
+    unsigned long drained = 0;
+    q_type v;
+    while (q.try_pop(&v)) {
+        crash_record(log, &v);
+        ++drained;
+    }
+
+    unsigned long acked = 0, missing = 0, extra = 0, allowed = 0, split = 0;
+    for (size_t i = 0; i < PRODUCERS; ++i) {
+        acked += log->acked[i];
+        // The batch in flight, unless the producer was done.
+        unsigned long seen = 0;
+        for (unsigned long seq = log->acked[i];
+                seq < log->acked[i] + BATCH && seq < N; ++seq)
+            seen += log->seen[i][seq];
+        if (seen && seen < BATCH)
+            ++split;
+        for (unsigned long seq = 0; seq < N; ++seq) {
+            if (seq < log->acked[i] && !log->seen[i][seq])
+                ++missing;
+            else if (seq >= log->acked[i] + BATCH && log->seen[i][seq])
+                ++extra;
+        }
+    }
+    for (size_t i = 0; i < CONSUMERS; ++i)
+        allowed += log->in_pop[i] * BATCH;
+
+    // A consumer killed before recording its items may split a batch.
+    bool ok = missing <= allowed && !extra && !log->torn &&
+              (redeliver || !log->dups) && (!split || allowed);
+    std::cout << "acked " << acked << ", drained " << drained
+              << ", missing " << missing << " (" << allowed << " allowed)"
+              << ", duplicated " << log->dups << ", unacked " << extra
+              << ", split " << split << ", torn " << log->torn << std::endl;
+    std::cout << (ok ? "Passed" : "FAILED") << std::endl;
+    return ok;
+}
+
+/*
+ * Print the time from t0, taken by get_timestamp() before the queue was
+ * opened, to the end of the first push into q after a crash. The crashed
+ * queue is likely full, so make room first.
+ */
+template<class Q>
+void
+first_push_test(Q &q, double t0)
+{
+    while (!q.try_push(x))
+        q.pop(y);
+    std::cout << "First push after " << (get_timestamp() - t0) / 1000
+              << "ms" << std::endl;
+}
+
+/*
+ * Open n queues called queue0, queue1, ... from one pool directory file,
+ * print how long that took and run the test on the first queue.
+ */
+template<class Q>
+void
+pool_test(size_t n)
+{
+    double t0 = get_timestamp();
+    pool_dir_t *pool = pool_dir_open(PMEM_DAXFS_PATH "/pool", POOL_SIZE);
+    assert(pool);
+
+    std::vector<std::unique_ptr<Q>> q;
+    for (size_t i = 0; i < n; ++i) {
+        std::string name = "queue" + std::to_string(i);
+        q.emplace_back(new Q(pool, name.c_str(), PRODUCERS, CONSUMERS));
+    }
+    std::cout << "Opening " << n << " queues took "
+              << (get_timestamp() - t0) / 1000 << "ms" << std::endl;
+
+    run_test<Q>(std::move(*q[0]));
+    q.clear();
+    pool_dir_close(pool);
+}
+
+/*
+ * Append stamped items to the log l and read all of them back in each of
+ * n_groups consumer groups, one thread per group. Every group must see
+ * the items of each producer in order; the first one also seeks back
+ * now and then and checks that the replayed items are the same.
+ */
+template<class L>
+void
+log_test(L &l, size_t n_groups)
+{
+    std::vector<std::thread> thr;
+    std::vector<int> grp;
+    std::atomic<unsigned long> bad(0), replays(0);
+
+    for (size_t g = 0; g < n_groups; ++g) {
+        std::string name = "group" + std::to_string(g);
+        grp.push_back(l.join(name.c_str()));
+        assert(grp.back() >= 0);
+        // Skip the items left by an earlier run.
+        l.seek(grp.back(), l.end());
+    }
+
+    struct timeval tv0, tv1;
+    gettimeofday(&tv0, NULL);
+
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        thr.emplace_back([&l, i] {
+        place_thread(PRODUCER, i);
+        set_thr_id(i);
+        q_type v[BATCH];
+        for (unsigned long seq = 0; seq < N; seq += BATCH) {
+            for (auto j = 0; j < BATCH; ++j)
+                crash_stamp(&v[j], i, seq + j);
+            l.append_n(v, BATCH);
+        }
+    });
+
+    for (size_t g = 0; g < n_groups; ++g)
+        thr.emplace_back([&, g] {
+        place_thread(CONSUMER, g);
+        unsigned long next[PRODUCERS] = {};
+        q_type v[BATCH], w[BATCH];
+        for (unsigned long k = 0; k < N * PRODUCERS; k += BATCH) {
+            auto off = l.offset(grp[g]);
+            l.read_n(grp[g], v, BATCH);
+            for (auto j = 0; j < BATCH; ++j) {
+                unsigned long tag;
+                ::memcpy(&tag, v[j].d_, sizeof(tag));
+                size_t id = tag >> 48;
+                if (id >= PRODUCERS || (tag & ((1UL << 48) - 1)) != next[id]++)
+                    bad.fetch_add(1);
+            }
+            // Replay the batch if it is still retained.
+            if (g == 0 && k % (QUEUE_SIZE / 2) == 0 &&
+                    l.seek(grp[g], off)) {
+                l.read_n(grp[g], w, BATCH);
+                if (::memcmp(v, w, sizeof(v)))
+                    bad.fetch_add(1);
+                replays.fetch_add(1);
+            }
+        }
+    });
+
+    for (auto &t : thr)
+        t.join();
+
+    gettimeofday(&tv1, NULL);
+    std::cout << "Test took " << (tv_to_ms(tv1) - tv_to_ms(tv0)) << "ms, "
+              << n_groups << " groups, " << replays.load() << " replays"
+              << std::endl;
+    std::cout << (bad.load() ? "FAILED" : "Passed") << std::endl;
+}
+
+/*
+ * Push stamped items into the lossy ring q as fast as possible while the
+ * consumers dawdle, then check that every item was either popped, in
+ * order per producer, or counted as dropped. The push latencies show
+ * that producers did not wait for the consumers.
+ */
+template<class Q>
+void
+lossy_test(Q &q)
+{
+    std::vector<std::thread> thr;
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long> popped(0), bad(0);
+
+    // Items recovered from an earlier run are not part of the test.
+    q_type old;
+    unsigned long stale = 0;
+    while (q.try_pop(&old))
+        ++stale;
+    if (stale)
+        std::cout << stale << " recovered items drained" << std::endl;
+    auto drops0 = q.drops();
+
+    struct timeval tv0, tv1;
+    gettimeofday(&tv0, NULL);
+
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        thr.emplace_back([&q, i] {
+        place_thread(PRODUCER, i);
+        set_thr_id(i);
+        q_type v;
+        for (unsigned long seq = 0; seq < N; ++seq) {
+            crash_stamp(&v, i, seq);
+#ifdef TIME_PUSH
+            q.push(&v);
+#else
+            auto t0 = rdtsc();
+            q.push(&v);
+            lat_record(LAT_PUSH, rdtsc() - t0);
+#endif
+        }
+    });
+
+    for (size_t i = 0; i < CONSUMERS; ++i)
+        thr.emplace_back([&, i] {
+        place_thread(CONSUMER, i);
+        set_thr_id(i);
+        unsigned long next[PRODUCERS] = {};
+        q_type v;
+        while (true) {
+            if (!q.try_pop(&v)) {
+                if (done.load())
+                    break;
+                std::this_thread::yield();
+                continue;
+            }
+            unsigned long tag;
+            ::memcpy(&tag, v.d_, sizeof(tag));
+            size_t id = tag >> 48;
+            unsigned long seq = tag & ((1UL << 48) - 1);
+            if (id >= PRODUCERS || seq < next[id])
+                bad.fetch_add(1);
+            else
+                next[id] = seq + 1;
+            popped.fetch_add(1);
+            // A slow consumer.
+            for (int k = 0; k < 256; ++k)
+                _mm_pause();
+        }
+    });
+
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        thr[i].join();
+    done.store(true);
+    for (size_t i = PRODUCERS; i < thr.size(); ++i)
+        thr[i].join();
+
+    gettimeofday(&tv1, NULL);
+    std::cout << "Test took " << (tv_to_ms(tv1) - tv_to_ms(tv0)) << "ms, "
+              << popped.load() << " popped, " << q.drops() - drops0
+              << " dropped" << std::endl;
+    lat_report();
+    bool ok = !bad.load() &&
+              popped.load() + q.drops() - drops0 == N * PRODUCERS;
+    std::cout << (ok ? "Passed" : "FAILED") << std::endl;
+}
+
+/*
+ * ------------------------------------------------------------------------
+ * Multi-process test, see LockFreeQueue::join().
+ *
+ * Every producer and consumer is a process of its own that opens the
+ * queue by name. Producers push items stamped with sequence numbers from
+ * 1, consumers record them in anonymous shared memory. With kill the
+ * first producer is killed halfway; the parent reaps and reclaims it, so
+ * its push in flight shows up as all-zero holes. The parent then pushes
+ * one stop item per consumer, so it needs a producer slot of its own.
+ * ------------------------------------------------------------------------
+ */
+struct IpcLog {
+    unsigned long pushed[PRODUCERS]; // Items whose push returned
+    unsigned long holes;             // All-zero items
+    unsigned long torn;              // Items with a damaged stamp
+    unsigned long dups;              // Items popped more than once
+    unsigned char seen[PRODUCERS][N];
+};
+
+template<class Q>
+static void
+ipc_worker(const char *name, IpcLog *log, size_t i)
+{
+    Q q(name, PRODUCERS + 1, CONSUMERS);
+    ThrRole role = i < PRODUCERS ? PRODUCER : CONSUMER;
+    long id = q.join(role);
+    assert(id >= 0);
+    set_thr_id(id);
+
+    q_type v[BATCH];
+    if (role == PRODUCER) {
+        for (unsigned long seq = 0; seq < N; seq += BATCH) {
+            for (auto j = 0; j < BATCH; ++j)
+                crash_stamp(&v[j], i, seq + j + 1);
+            q.push_n(v, BATCH);
+            __atomic_store_n(&log->pushed[i], seq + BATCH, __ATOMIC_RELEASE);
+        }
+    } else {
+        while (true) {
+            unsigned long tag, end;
+            q.pop(v);
+            ::memcpy(&tag, v->d_, sizeof(tag));
+            ::memcpy(&end, v->d_ + SLOT_SIZE - sizeof(end), sizeof(end));
+
+            size_t id = tag >> 48;
+            unsigned long seq = (tag & ((1UL << 48) - 1)) - 1;
+            if (!tag && !end)
+                __sync_fetch_and_add(&log->holes, 1);
+            else if (tag == end && id == PRODUCERS)
+                break;
+            else if (tag != end || id >= PRODUCERS || seq >= N)
+                __sync_fetch_and_add(&log->torn, 1);
+            else if (__atomic_exchange_n(&log->seen[id][seq], 1,
+                                         __ATOMIC_SEQ_CST))
+                __sync_fetch_and_add(&log->dups, 1);
+        }
+    }
+    q.leave(role, id);
+}
+
+template<class Q>
+void
+ipc_test(const char *name, bool kill)
+{
+    auto *log = (IpcLog *)mmap(NULL, sizeof(IpcLog), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(log != MAP_FAILED);
+    ::unlink((std::string(PMEM_DAXFS_PATH "/") + name).c_str());
+    Q q(name, PRODUCERS + 1, CONSUMERS);
+
+    struct timeval tv0, tv1;
+    gettimeofday(&tv0, NULL);
+
+    std::vector<pid_t> pids;
+    for (size_t i = 0; i < PRODUCERS + CONSUMERS; ++i) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (!pid) {
+            ipc_worker<Q>(name, log, i);
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+
+    if (kill) {
+        while (__atomic_load_n(&log->pushed[0], __ATOMIC_ACQUIRE) < N / 2)
+            sched_yield();
+        ::kill(pids[0], SIGKILL);
+    }
+    // Consumers stall behind the killed one, so reclaim it first.
+    size_t reclaimed = 0;
+    for (size_t i = 0; i < PRODUCERS; ++i) {
+        waitpid(pids[i], NULL, 0);
+        reclaimed += q.reclaim();
+    }
+
+    long id = q.join(PRODUCER);
+    assert(id >= 0);
+    set_thr_id(id);
+    q_type stop;
+    crash_stamp(&stop, PRODUCERS, 1);
+    for (size_t i = 0; i < CONSUMERS; ++i)
+        q.push(&stop);
+    q.leave(PRODUCER, id);
+    for (size_t i = PRODUCERS; i < pids.size(); ++i)
+        waitpid(pids[i], NULL, 0);
+    gettimeofday(&tv1, NULL);
+
+    /*
+     * Every producer's items went through. The killed one got as far as
+     * the first one missing; only its push in flight may be lost.
+     */
+    unsigned long missing = 0, extra = 0;
+    for (size_t i = 0; i < PRODUCERS; ++i) {
+        unsigned long seq = 0;
+        if (kill && i == 0)
+            while (seq < N && log->seen[i][seq])
+                ++seq;
+        for (; seq < N; ++seq) {
+            if (kill && i == 0)
+                extra += log->seen[i][seq];
+            else
+                missing += !log->seen[i][seq];
+        }
+    }
+    std::cout << "Test took " << (tv_to_ms(tv1) - tv_to_ms(tv0)) << "ms, "
+              << PRODUCERS + CONSUMERS << " processes, reclaimed "
+              << reclaimed << " slots" << std::endl;
+    std::cout << "missing " << missing << ", after a gap " << extra
+              << ", holes " << log->holes << ", duplicated " << log->dups
+              << ", torn " << log->torn << std::endl;
+    bool ok = !missing && !extra && log->holes <= BATCH && !log->dups &&
+              !log->torn;
+    std::cout << (ok ? "Passed" : "FAILED") << std::endl;
+    munmap(log, sizeof(IpcLog));
+}
+
 #endif /* Q_TEST_COMMON_H */
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#ifndef Q_WAIT_H
+#define Q_WAIT_H
+
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "config.h"
+#include "util.h"
+
+/*
+ * ------------------------------------------------------------------------
+ * Adaptive waiting for queue producers and consumers.
+ *
+ * A waiting thread polls its condition for SPIN_COUNT rounds, then yields
+ * the CPU for YIELD_COUNT rounds, and then sleeps on a futex until the
+ * other side of the queue changes state. The publishing side only pays
+ * a fence and a load while nobody sleeps.
+ * ------------------------------------------------------------------------
+ */
+class WaitEvent {
+public:
+    WaitEvent()
+        : seq_(0),
+          waiters_(0),
+          private_(FUTEX_PRIVATE_FLAG)
+    {}
+
+    /*
+     * Forget sleepers of a previous run, e.g. for objects living in PMEM.
+     * A shared event wakes up sleepers in other processes mapping it.
+     */
+    void
+    reset(bool shared = false)
+    {
+        seq_.store(0);
+        waiters_.store(0);
+        private_ = shared ? 0 : FUTEX_PRIVATE_FLAG;
+    }
+
+    // Wake up all sleepers. Call after the state change is visible.
+    void
+    notify()
+    {
+        /*
+         * Order the state change before the waiters_ load, wait_until()
+         * does the opposite, so either we see the sleeper or it sees
+         * the new state.
+         */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (UNLIKELY(waiters_.load(std::memory_order_relaxed))) {
+            seq_.fetch_add(1);
+            futex(FUTEX_WAKE, INT_MAX);
+        }
+    }
+
+    // Wait until ready() returns true.
+    template<class F>
+    void
+    wait_until(F ready)
+    {
+        for (unsigned i = 0; i < SPIN_COUNT; ++i) {
+            if (ready())
+                return;
+            _mm_pause();
+        }
+        for (unsigned i = 0; i < YIELD_COUNT; ++i) {
+            if (ready())
+                return;
+            sched_yield();
+        }
+
+        while (true) {
+            waiters_.fetch_add(1);
+            uint32_t seq = seq_.load();
+            if (ready()) {
+                waiters_.fetch_sub(1);
+                return;
+            }
+            // Returns at once if notify() bumped seq_ after our load.
+            futex(FUTEX_WAIT, seq);
+            waiters_.fetch_sub(1);
+        }
+    }
+
+private:
+    long
+    futex(int op, uint32_t val)
+    {
+        return syscall(SYS_futex, &seq_, op | private_, val, NULL, NULL, 0);
+    }
+
+    std::atomic<uint32_t> seq_;
+    std::atomic<uint32_t> waiters_;
+    // FUTEX_PRIVATE_FLAG unless other processes share the event.
+    int                   private_;
+};
+
+/*
+ * Lets one thread at a time recompute a value shared by all waiters,
+ * e.g. the lowest head or tail. The others keep using the last
+ * published value rather than repeating the same scan.
+ */
+class Combiner {
+public:
+    Combiner()
+        : busy_(false)
+    {}
+
+    void
+    reset()
+    {
+        busy_.store(false);
+    }
+
+    // Run f() unless another thread is running it already.
+    template<class F>
+    void
+    try_run(F f)
+    {
+        if (busy_.load(std::memory_order_relaxed) ||
+                busy_.exchange(true, std::memory_order_acquire))
+            return;
+        f();
+        busy_.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> busy_;
+};
+
+#endif /* Q_WAIT_H */
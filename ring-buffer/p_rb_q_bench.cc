@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lf_queue.h"
+#include "pool_dir.h"
+#include "bench.h"
+
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+// Builds the queue of a bench run under policy P, see bench_dispatch().
+template<class P>
+struct PolicyBench {
+    template<class T, unsigned long Q_SIZE>
+    struct B {
+        typedef std::integral_constant<bool, P::PERSISTENT && !P::TX> InPool;
+
+        // Log-free persistent queues live in a fresh pool directory.
+        template<class Q>
+        static void
+        run_in(const BenchOpts &o, std::true_type)
+        {
+            pool_dir_t *pool = bench_pool_open(o);
+            assert(pool);
+            {
+                Q q(pool, "bench", o.producers, o.consumers);
+                run_bench<Q, T>(q, o);
+            }
+            pool_dir_close(pool);
+        }
+
+        // The others in DRAM or, with transactions, a fresh pool file.
+        template<class Q>
+        static void
+        run_in(const BenchOpts &o, std::false_type)
+        {
+            const char *path = PMEM_DAXFS_PATH "/queue";
+
+            if (P::TX)
+                unlink(path);
+            {
+                Q q(o.producers, o.consumers);
+                run_bench<Q, T>(q, o);
+            }
+            if (P::TX)
+                unlink(path);
+        }
+
+        template<bool SP, bool SC>
+        static void
+        run_path(const BenchOpts &o)
+        {
+            typedef LockFreeQueue<T, P, thr_id, Q_SIZE, SP, SC> Q;
+            run_in<Q>(o, InPool());
+        }
+
+        static void
+        run(const BenchOpts &o)
+        {
+            if (bench_sp(o) && bench_sc(o))
+                run_path<true, true>(o);
+            else if (bench_sp(o))
+                run_path<true, false>(o);
+            else if (bench_sc(o))
+                run_path<false, true>(o);
+            else
+                run_path<false, false>(o);
+        }
+    };
+};
+
+template<class P>
+bool
+bench_policy(BenchOpts &o)
+{
+    o.policy = P::name();
+    return bench_dispatch<PolicyBench<P>::template B>(o);
+}
+
+static const struct {
+    const char *name;
+    bool (*run)(BenchOpts &);
+} policies[] = {
+    {"volatile",    bench_policy<Volatile>},
+    {"eadr",        bench_policy<Eadr>},
+    {"adr",         bench_policy<Adr>},
+    {"adr-compact", bench_policy<AdrCompact>},
+    {"adr-group",   bench_policy<AdrGroup>},
+    {"msync",       bench_policy<Msync>},
+    {"adr-tx",      bench_policy<AdrTx>},
+};
+
+
+int
+main(int argc, char **argv)
+{
+    BenchOpts o;
+    if (!bench_parse(argc, argv, o))
+        return 1;
+
+    bool all = strcmp(o.policies, "all") == 0;
+    std::string list = std::string(",") + o.policies + ",";
+    size_t found = 0;
+
+    for (auto &p : policies) {
+        if (!all && list.find(std::string(",") + p.name + ",") ==
+                std::string::npos)
+            continue;
+        if (!p.run(o))
+            return 1;
+        ++found;
+    }
+    if (!found) {
+        std::cerr << "Unknown policy " << o.policies << std::endl;
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
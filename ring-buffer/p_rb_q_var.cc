@@ -0,0 +1,723 @@
+/*
+ * Copyright (c) 2020, The Ohio State University. All rights reserved.
+ *
+ * This file is part of the PMIdioBench software package developed by
+ * the team members of Prof. Xiaoyi Lu's group at The Ohio State University.
+ *
+ * For detailed copyright and licensing information, please refer to the license
+ * file LICENSE in the top level directory.
+ *
+ */
+
+/**
+ * Copyright (C) 2012-2013 Alexander Krizhanovsky (ak@tempesta-tech.com).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/time.h>
+#include <limits.h>
+#include <malloc.h>
+#include <string.h>
+#include <unistd.h>
+#include <immintrin.h>
+#include <libpmem.h>
+
+#include "config.h"
+#include "util.h"
+#include "timer.h"
+#include "wait.h"
+#include "pmem_copy.h"
+#include "pool_dir.h"
+#include "test_common.h"
+
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <list>
+#include <vector>
+#include <iterator>
+#include <csignal>
+
+void
+term(int)
+{
+    std::cout << "Caught SIGINT! Exiting Gracefully!" << std::endl;
+    // Call destructors on all live objects.
+    exit(0);
+}
+
+
+/*
+ * ------------------------------------------------------------------------
+ * Lock-free N-producers M-consumers ring-buffer queue of variable-length
+ * records.
+ *
+ * The ring is a byte array whose capacity is chosen when the PMEM pool is
+ * created and is stored in the pool header. Records are packed into it as
+ * a length word followed by the payload, padded to REC_ALIGN bytes, and
+ * may wrap around the end of the ring. head_ and tail_ are byte positions.
+ *
+ * Producers reserve a record with one fetch-and-add on head_ as in
+ * LockFreeQueue. Consumers do not know the size of the next record before
+ * reading its length word, so they advance tail_ with compare-and-swap
+ * once the record at their snapshot of tail_ has been written.
+ * ------------------------------------------------------------------------
+ */
+template<decltype(thr_id) ThrId = thr_id>
+class VarLockFreeQueue
+{
+private:
+    /*
+     * Alignment of records (and their length words) in the ring. With
+     * XPLINE_SLOTS records start at XPLines, so a record never shares
+     * a media line with the previous one.
+     */
+#ifdef XPLINE_SLOTS
+    static const unsigned long REC_ALIGN = XPLINE_SIZE;
+#else
+    static const unsigned long REC_ALIGN = sizeof(unsigned long);
+#endif
+
+    struct PoolHdr {
+        uint64_t magic;
+        // ring capacity in bytes
+        uint64_t capacity;
+    };
+
+    struct ThrPos {
+        unsigned long head ____cacheline_aligned;
+        unsigned long tail ____cacheline_aligned;
+        unsigned long pos_pop ____cacheline_aligned;
+        // size in bytes of the record popped at pos_pop (same cache line)
+        unsigned long n_pop;
+        unsigned long pos_push ____cacheline_aligned;
+        // size in bytes of the record pushed at pos_push (same cache line)
+        unsigned long n_push;
+    };
+
+    // Size taken in the ring by a record with len bytes of payload.
+    static unsigned long
+    rec_size(size_t len)
+    {
+        return roundup(sizeof(unsigned long) + len, REC_ALIGN);
+    }
+
+    // Construct file path to use for PMEM pool.
+    void
+    pmem_path(std::string &path) const
+    {
+        // Create PMEM file path.
+        path = PMEM_DAXFS_PATH;
+        path += "/";
+        path += "queue";
+    }
+
+    // Calculate required PMEM pool size for queue.
+    size_t
+    pmem_size() const
+    {
+        auto pagesize = getpagesize();
+        auto n = std::max(n_consumers_, n_producers_);
+        return roundup(sizeof(ThrPos) * n, pagesize) +
+               roundup(capacity_, pagesize) +
+               roundup(sizeof(QInfo), pagesize) +
+               pagesize;
+    }
+
+    // Allocate PMEM pool.
+    void *
+    pmempool_alloc(std::string &path, size_t size) const
+    {
+        // Create pmem file and memory map it.
+        return pmem_map_file(path.c_str(), size,
+                             PMEM_FILE_CREATE, 0666,
+                             NULL, NULL);
+    }
+
+    // Read capacity of an existing pool, or return 0 if there is none.
+    size_t
+    pmempool_capacity(std::string &path) const
+    {
+        size_t len, capacity = 0;
+
+        if (access(path.c_str(), F_OK) == -1)
+            return 0;
+
+        auto *hdr = (PoolHdr *)pmem_map_file(path.c_str(), 0, 0, 0,
+                                             &len, NULL);
+        if (!hdr)
+            return 0;
+        if (len >= sizeof(PoolHdr) && hdr->magic == VAR_QUEUE_MAGIC)
+            capacity = hdr->capacity;
+        pmem_unmap(hdr, len);
+        return capacity;
+    }
+
+    // Compute last head.
+    unsigned long
+    find_last_head() const
+    {
+        auto min = qi_->head_;
+
+        // Find the last head.
+        for (size_t i = 0; i < n_producers_; ++i) {
+            auto tmp_t = thr_p_[i].head;
+
+            // Force compiler to use tmp_h exactly once.
+            CMB();
+
+            if (tmp_t < min)
+                min = tmp_t;
+        }
+        return min;
+    }
+
+    // Compute last tail.
+    unsigned long
+    find_last_tail() const
+    {
+        auto min = qi_->tail_;
+
+        // Find the last tail.
+        for (size_t i = 0; i < n_consumers_; ++i) {
+            auto tmp_t = thr_p_[i].tail;
+
+            // Force compiler to use tmp_h exactly once.
+            CMB();
+
+            if (tmp_t < min)
+                min = tmp_t;
+        }
+        return min;
+    }
+
+    /*
+     * Advance last_head_ unless another thread is doing it already.
+     * A stale last_head_ is still safe: the lowest head never goes
+     * back, so only a higher value is published.
+     */
+    void
+    update_last_head()
+    {
+        head_scan_.try_run([&] {
+            auto h = find_last_head();
+            if (h > qi_->last_head_) {
+                qi_->last_head_ = h;
+                // Consumers sleeping meanwhile missed the update.
+                head_ev_.notify();
+            }
+        });
+    }
+
+    // Advance last_tail_, see update_last_head().
+    void
+    update_last_tail()
+    {
+        tail_scan_.try_run([&] {
+            auto t = find_last_tail();
+            if (t > qi_->last_tail_) {
+                qi_->last_tail_ = t;
+                tail_ev_.notify();
+            }
+        });
+    }
+
+    // Copy len bytes to the ring starting at byte position pos.
+    void
+    copy_to_ring(unsigned long pos, const void *ptr, size_t len)
+    {
+        auto idx = pos & mask_;
+        auto n1 = std::min(len, (size_t)(capacity_ - idx));
+
+        pmem_copy_nodrain(ring_ + idx, ptr, n1);
+        if (UNLIKELY(n1 < len))
+            pmem_copy_nodrain(ring_, (const char *)ptr + n1, len - n1);
+    }
+
+    // Copy len bytes from the ring starting at byte position pos.
+    void
+    copy_from_ring(unsigned long pos, void *ptr, size_t len) const
+    {
+        auto idx = pos & mask_;
+        auto n1 = std::min(len, (size_t)(capacity_ - idx));
+
+        memcpy(ptr, ring_ + idx, n1);
+        if (UNLIKELY(n1 < len))
+            memcpy((char *)ptr + n1, ring_, len - n1);
+    }
+
+    // Payload length of the record at byte position pos.
+    unsigned long
+    rec_len(unsigned long pos) const
+    {
+        // Length words are aligned, so they never wrap.
+        return *(volatile unsigned long *)(ring_ + (pos & mask_));
+    }
+
+    // Move the record of size bytes at src to dst during recovery.
+    void
+    move_rec(unsigned long dst, unsigned long src, unsigned long size,
+             std::vector<char> &buf)
+    {
+        buf.resize(size);
+        copy_from_ring(src, buf.data(), size);
+        copy_to_ring(dst, buf.data(), size);
+        pmem_drain();
+    }
+
+    // Init internal state.
+    void
+    init()
+    {
+        auto n = std::max(n_consumers_, n_producers_);
+        // Set per thread tail, head, and pos to ULONG_MAX.
+        ::memset((void *)thr_p_, 0xFF, sizeof(ThrPos) * n);
+
+        // Initialize queue parameters.
+        qi_->tail_      = 0;
+        qi_->head_      = 0;
+        qi_->last_head_ = 0;
+        qi_->last_tail_ = 0;
+    }
+
+    /*
+     * Recover internal state.
+     *
+     * Completed pushes beyond the first in-flight one are moved down to
+     * close the gap, as in LockFreeQueue. Then the packed records between
+     * last_tail_ and last_head_ are walked through their length words:
+     * records that consumers completed popping are dropped, and the rest
+     * are moved up against last_head_ so the queue is contiguous again.
+     */
+    void
+    recover()
+    {
+        std::vector<char> buf;
+
+        // Update the last_head_.
+        qi_->last_head_ = find_last_head();
+        std::cout << "last_head_=" << (qi_->last_head_ & mask_) << std::endl;
+
+        // Update the last_tail_.
+        qi_->last_tail_ = find_last_tail();
+        std::cout << "last_tail_=" << (qi_->last_tail_ & mask_) << std::endl;
+
+        // Find sorted list of records to be copied.
+        std::list<std::pair<unsigned long, size_t>> pushed_recs;
+        for (size_t i = 0; i < n_producers_; ++i) {
+            ThrPos &tp = thr_p_[i];
+            if (tp.head == ULONG_MAX &&
+                tp.pos_push > qi_->last_head_ &&
+                tp.pos_push != ULONG_MAX)
+                pushed_recs.push_back(std::make_pair(tp.pos_push, i));
+        }
+        pushed_recs.sort();
+
+        // Iterate through sorted list and copy records.
+        auto dst = qi_->last_head_;
+        for (auto it = pushed_recs.begin(); it != pushed_recs.end(); ++it) {
+            auto src = std::get<0>(*it);
+            auto size = thr_p_[std::get<1>(*it)].n_push;
+            if (dst < src)
+                move_rec(dst, src, size, buf);
+            dst += size;
+        }
+        qi_->last_head_ = dst;
+
+        // Find sorted list of popped records.
+        std::list<unsigned long> popped_recs;
+        for (size_t i = 0; i < n_consumers_; ++i) {
+            ThrPos &tp = thr_p_[i];
+            if (tp.tail == ULONG_MAX &&
+                tp.pos_pop >= qi_->last_tail_ &&
+                tp.pos_pop < qi_->last_head_)
+                popped_recs.push_back(tp.pos_pop);
+        }
+        popped_recs.sort();
+
+        // Walk the packed records and collect the ones not popped yet.
+        std::vector<std::pair<unsigned long, unsigned long>> live_recs;
+        auto it = popped_recs.begin();
+        for (auto pos = qi_->last_tail_; pos < qi_->last_head_; ) {
+            auto size = rec_size(rec_len(pos));
+
+            while (it != popped_recs.end() && *it < pos)
+                ++it;
+            if (it == popped_recs.end() || *it != pos)
+                live_recs.push_back(std::make_pair(pos, size));
+            pos += size;
+        }
+
+        // Move live records up against last_head_, last one first.
+        dst = qi_->last_head_;
+        for (auto r = live_recs.rbegin(); r != live_recs.rend(); ++r) {
+            dst -= std::get<1>(*r);
+            if (dst != std::get<0>(*r))
+                move_rec(dst, std::get<0>(*r), std::get<1>(*r), buf);
+        }
+        qi_->last_tail_ = dst;
+        std::cout << "recovered " << live_recs.size() << " records"
+                  << std::endl;
+
+        qi_->head_ = qi_->last_head_;
+        qi_->tail_ = qi_->last_tail_;
+        pmem_persist(qi_, sizeof(QInfo));
+
+        // Positions recorded before the crash are stale now.
+        for (size_t i = 0; i < n_producers_; ++i) {
+            thr_p_[i].head = ULONG_MAX;
+            thr_p_[i].pos_push = ULONG_MAX;
+        }
+        for (size_t i = 0; i < n_consumers_; ++i) {
+            thr_p_[i].tail = ULONG_MAX;
+            thr_p_[i].pos_pop = ULONG_MAX;
+        }
+        auto n = std::max(n_consumers_, n_producers_);
+        pmem_persist(thr_p_, sizeof(ThrPos) * n);
+    }
+
+    // Carve the queue out of a PMEM region, then recover or init it.
+    void
+    attach(char *ptr)
+    {
+        auto n = std::max(n_consumers_, n_producers_);
+        PoolHdr *hdr = (PoolHdr *)ptr;
+
+        size_t pagesize = getpagesize();
+        ptr += pagesize;
+        thr_p_ = (ThrPos *)ptr;
+
+        ptr += roundup(sizeof(ThrPos) * n, pagesize);
+        ring_ = ptr;
+
+        ptr += roundup(capacity_, pagesize);
+        qi_ = (QInfo *)ptr;
+
+        // Check if we should recover
+        if (hdr->magic == VAR_QUEUE_MAGIC) {
+            // Recover internal state.
+            recover();
+        } else {
+            // Init internal state.
+            init();
+            hdr->capacity = capacity_;
+            pmem_persist(hdr, pmem_size());
+
+            // Once initialization is complete, set magic no.
+            hdr->magic = VAR_QUEUE_MAGIC;
+            pmem_persist(hdr, pagesize);
+        }
+    }
+
+public:
+    /*
+     * Create a queue whose ring holds capacity bytes (rounded up to a
+     * power of two). A persistent queue that already exists keeps the
+     * capacity stored in its pool header.
+     */
+    VarLockFreeQueue(size_t n_producers, size_t n_consumers,
+                     bool is_persistent, size_t capacity)
+        : n_producers_(n_producers),
+          n_consumers_(n_consumers),
+          is_persistent_(is_persistent),
+          pool_(NULL)
+    {
+        auto n = std::max(n_consumers, n_producers);
+        std::string path;
+
+        capacity_ = REC_ALIGN;
+        while (capacity_ < capacity)
+            capacity_ <<= 1;
+
+        if (is_persistent) {
+            pmem_path(path);
+            auto pool_capacity = pmempool_capacity(path);
+            if (pool_capacity)
+                capacity_ = pool_capacity;
+        }
+        mask_ = capacity_ - 1;
+
+        if (is_persistent) {
+            char *ptr = (char *)pmempool_alloc(path, pmem_size());
+            assert(ptr);
+            attach(ptr);
+        } else {
+            thr_p_ = (ThrPos *)::memalign(getpagesize(),
+                                          sizeof(ThrPos) * n);
+
+            ring_ = (char *)::memalign(getpagesize(), capacity_);
+
+            qi_ = (QInfo *)::memalign(getpagesize(),
+                                      sizeof(QInfo));
+
+            assert(thr_p_);
+            assert(ring_);
+            assert(qi_);
+            first_touch(ring_, capacity_);
+
+            // Init internal state.
+            init();
+        }
+    }
+
+    /*
+     * Open or create the queue called name in a pool directory. Unlike a
+     * queue with its own file, the capacity must match the one it was
+     * created with.
+     */
+    VarLockFreeQueue(pool_dir_t *pool, const char *name,
+                     size_t n_producers, size_t n_consumers, size_t capacity)
+        : n_producers_(n_producers),
+          n_consumers_(n_consumers),
+          is_persistent_(true),
+          pool_(pool)
+    {
+        capacity_ = REC_ALIGN;
+        while (capacity_ < capacity)
+            capacity_ <<= 1;
+        mask_ = capacity_ - 1;
+
+        uint64_t geom[POOL_GEOM_LEN] = {capacity_, REC_ALIGN, n_producers,
+                                        n_consumers
+                                       };
+        char *ptr = (char *)pool_dir_get(pool, name, VAR_QUEUE_MAGIC, geom,
+                                         pmem_size());
+        assert(ptr);
+        attach(ptr);
+    }
+
+    ~VarLockFreeQueue()
+    {
+        if (is_persistent_) {
+            char *ptr = (char *)thr_p_ - getpagesize();
+            // A pool directory owns its mapping.
+            if (!pool_)
+                pmem_unmap(ptr, pmem_size());
+        } else {
+            ::free(ring_);
+            ::free(thr_p_);
+            ::free(qi_);
+        }
+    }
+
+    ThrPos &
+    thr_pos() const
+    {
+        assert(ThrId() < std::max(n_consumers_, n_producers_));
+        return thr_p_[ThrId()];
+    }
+
+    // Ring capacity in bytes.
+    size_t
+    capacity() const
+    {
+        return capacity_;
+    }
+
+    // Push a record of len bytes.
+    void
+    push(const void *ptr, size_t len)
+    {
+#ifdef TIME_PUSH
+        TIMER_HP_REGISTER();
+        TIMER_HP_START("push");
+#endif
+
+        unsigned long size = rec_size(len);
+        assert(size <= capacity_);
+        ThrPos &tp = thr_pos();
+        /*
+         * Request next place to push.
+         * See comments for LockFreeQueue::push().
+         */
+        tp.head = qi_->head_;
+        if (is_persistent_) {
+            pmem_persist(&tp.head, sizeof(tp.head));
+            tp.head = __sync_fetch_and_add(&qi_->head_, size);
+            pmem_flush(&qi_->head_, sizeof(qi_->head_));
+            pmem_flush(&tp.head, sizeof(tp.head));
+            pmem_drain();
+        } else {
+            tp.head = __sync_fetch_and_add(&qi_->head_, size);
+        }
+
+        // Wait until the whole record fits behind the lowest tail.
+        if (UNLIKELY(tp.head + size > qi_->last_tail_ + capacity_)) {
+            tail_ev_.wait_until([&] {
+                // Update the last_tail_.
+                update_last_tail();
+                return tp.head + size <= qi_->last_tail_ + capacity_;
+            });
+        }
+
+        unsigned long hdr = len;
+        copy_to_ring(tp.head, &hdr, sizeof(hdr));
+        copy_to_ring(tp.head + sizeof(hdr), ptr, len);
+        /*
+         * n_push shares the cache line with pos_push and is written
+         * first, so a persisted pos_push always has a valid size.
+         */
+        tp.n_push = size;
+        tp.pos_push = tp.head;
+        CMB();
+        if (is_persistent_) {
+            pmem_flush(&tp.pos_push,
+                       sizeof(tp.pos_push) + sizeof(tp.n_push));
+            pmem_drain();
+        }
+
+        // Allow consumers to eat the record.
+        tp.head = ULONG_MAX;
+        if (is_persistent_) {
+            pmem_persist(&tp.head, sizeof(tp.head));
+        }
+        head_ev_.notify();
+#ifdef TIME_PUSH
+        lat_record(LAT_PUSH, TIMER_HP_ELAPSED());
+#endif
+    }
+
+    /*
+     * Pop the next record into a buffer of buf_len bytes.
+     * @return payload length of the record.
+     */
+    size_t
+    pop(void *ptr, size_t buf_len)
+    {
+#ifdef TIME_POP
+        TIMER_HP_REGISTER();
+        TIMER_HP_START("pop");
+#endif
+
+        unsigned long len, size;
+        ThrPos &tp = thr_pos();
+        /*
+         * Request next place from which to pop.
+         *
+         * tp.tail never exceeds the position we finally pop from, so
+         * producers can not overwrite the record while we read its length.
+         */
+        tp.tail = qi_->tail_;
+        if (is_persistent_) {
+            pmem_persist(&tp.tail, sizeof(tp.tail));
+        }
+        while (true) {
+            // The record at tp.tail is complete once below last_head_.
+            if (UNLIKELY(tp.tail >= qi_->last_head_)) {
+                head_ev_.wait_until([&] {
+                    // Update the last_head_.
+                    update_last_head();
+                    return tp.tail < qi_->last_head_;
+                });
+            }
+
+            len = rec_len(tp.tail);
+            size = rec_size(len);
+            if (__sync_bool_compare_and_swap(&qi_->tail_, tp.tail,
+                                             tp.tail + size))
+                break;
+
+            // Somebody else took it, retry with the newer tail.
+            tp.tail = qi_->tail_;
+        }
+        if (is_persistent_) {
+            pmem_flush(&qi_->tail_, sizeof(qi_->tail_));
+            pmem_flush(&tp.tail, sizeof(tp.tail));
+            pmem_drain();
+        }
+
+        assert(len <= buf_len);
+        copy_from_ring(tp.tail + sizeof(unsigned long), ptr, len);
+        // See push() for the ordering of n_pop and pos_pop.
+        tp.n_pop = size;
+        tp.pos_pop = tp.tail;
+        CMB();
+        if (is_persistent_) {
+            pmem_persist(&tp.pos_pop,
+                         sizeof(tp.pos_pop) + sizeof(tp.n_pop));
+        }
+
+        // Allow producers to rewrite the bytes.
+        tp.tail = ULONG_MAX;
+        if (is_persistent_) {
+            pmem_persist(&tp.tail, sizeof(tp.tail));
+        }
+        tail_ev_.notify();
+#ifdef TIME_POP
+        lat_record(LAT_POP, TIMER_HP_ELAPSED());
+#endif
+        return len;
+    }
+
+private:
+    /*
+     * The most hot members are cacheline aligned to avoid
+     * False Sharing.
+     */
+
+    struct QInfo {
+        // currently free byte position (next to insert)
+        unsigned long head_ ____cacheline_aligned;
+        // current tail byte position, next to pop
+        unsigned long tail_ ____cacheline_aligned;
+        // last not-processed producer's pointer
+        unsigned long last_head_ ____cacheline_aligned;
+        // last not-processed consumer's pointer
+        unsigned long last_tail_ ____cacheline_aligned;
+    };
+
+    const size_t  n_producers_, n_consumers_;
+    const bool    is_persistent_;
+    // Pool hosting the queue, NULL if it has its own file.
+    pool_dir_t    *pool_;
+    size_t        capacity_, mask_;
+    QInfo         *qi_;
+    ThrPos        *thr_p_;
+    char          *ring_;
+    // Sleeping consumers wait for head_ev_, producers for tail_ev_.
+    WaitEvent     head_ev_, tail_ev_;
+    // Only one thread at a time scans for last_head_ and last_tail_.
+    Combiner      head_scan_, tail_scan_;
+};
+
+
+int
+main(int argc, char **argv)
+{
+    typedef VarLockFreeQueue<> VarQueue;
+
+    // Set signal handler.
+    signal(SIGINT, term);
+
+    // Ring capacity in bytes, only used when a new pool is created.
+    size_t capacity = RING_CAPACITY;
+    if (argc > 2)
+        capacity = strtoul(argv[2], NULL, 0);
+
+    if (argc > 1 && strcmp(argv[1], "true") == 0) {
+        std::cout << "Testing Persistent Lock Free Var Queue" << std::endl;
+        VarQueue p_lf_q(PRODUCERS, CONSUMERS, true, capacity);
+        run_test<VarQueue, VarProducer<VarQueue>, VarConsumer<VarQueue>>(
+            std::move(p_lf_q));
+    } else {
+        std::cout << "Testing Volatile Lock Free Var Queue" << std::endl;
+        VarQueue lf_q(PRODUCERS, CONSUMERS, false, capacity);
+        run_test<VarQueue, VarProducer<VarQueue>, VarConsumer<VarQueue>>(
+            std::move(lf_q));
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+### Kill a persistent RB queue with SIGKILL at random points of push and
+### pop, recover it and check that no acknowledged item was lost or
+### duplicated. Runs on /dev/shm, no PMEM needed.
+### Usage: ./crash_inject.sh [rounds] [APP] [compact|group|msync|pending]
+### Example: ./crash_inject.sh 200 p_rb_q_exp.x compact
+
+# Directory of the queue and the crash log
+: ${PMEM_DIR:="/dev/shm"}
+
+# Crash points to pick from, see CRASH_POINT() in include/lf_queue.h
+: ${SITES:="reserve_head reserve_head_flush copy publish_head_flush publish_head reserve_tail reserve_tail_flush release_tail"}
+
+# Kill at most after so many crash points
+: ${MAX_AT:=200000}
+
+# Build parameters
+: ${BUILD:="NPRODUCERS=4 NCONSUMERS=4 SLOT_SIZE=64 BATCH_SIZE=4"}
+
+export PMEM_IS_PMEM_FORCE=1
+
+function cleanup()
+{
+	rm -f $PMEM_DIR/queue $PMEM_DIR/crash_log
+}
+
+function main()
+{
+	ROUNDS=${1:-100}
+	APP=${2:-p_rb_q_exp.x}
+	MODE=$3
+	SITES=($SITES)
+
+	make -s clean
+	make -s CRASH=y PMEM_DIR=$PMEM_DIR $BUILD $APP || exit 1
+
+	FAILED=0
+	for R in $(seq $ROUNDS); do
+		cleanup
+		# Every third round counts all sites
+		if [ $((R % 3)) -eq 0 ]; then
+			SITE=""
+		else
+			SITE=${SITES[$((RANDOM % ${#SITES[@]}))]}
+		fi
+		AT=$(((RANDOM * 32768 + RANDOM) % MAX_AT + 1))
+
+		echo "round $R: site ${SITE:-any}, point $AT"
+		CRASH_SITE=$SITE CRASH_AT=$AT ./$APP inject $MODE > /dev/null
+		./$APP verify $MODE | tail -2
+		if [ ${PIPESTATUS[0]} -ne 0 ]; then
+			FAILED=$((FAILED + 1))
+		fi
+	done
+	cleanup
+
+	echo "$FAILED of $ROUNDS rounds failed"
+
+	# Leave the default build behind
+	make -s clean
+	make -s
+	[ $FAILED -eq 0 ]
+}
+
+main $@
@@ -1,8 +1,3 @@
 #!/bin/bash
 
-re='^[0-9]+$'
-for line in $(cat output.log); do
-	if [[ $line =~ $re ]]; then
-		echo $line
-	fi
-done
+grep "^LAT" output.log
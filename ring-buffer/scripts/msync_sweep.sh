@@ -0,0 +1,43 @@
+#!/bin/bash
+### Compare group commit on PMEM with group commit through the page cache
+### at several msync() periods and print the JSON results of
+### p_rb_q_bench.x. Give each directory its own run, e.g. a DAX mount and
+### a file system on an SSD; adr-group picks msync() by itself on the
+### latter, msync always uses it.
+### Usage: ./msync_sweep.sh [bench args]
+### Example: DIRS="/mnt/pmem1 /mnt/ssd" ./msync_sweep.sh -p 4 -c 4 -d 5000
+
+# Directories to test in
+: ${DIRS:="/mnt/pmem1"}
+
+# Persister periods of msync() group commit, in microseconds
+: ${PERIODS:="100 1000 10000"}
+
+function cleanup()
+{
+	rm -f $1/bench $1/queue
+}
+
+function main()
+{
+	APP=p_rb_q_bench.x
+	ARGS=${@:--p 4 -c 4}
+
+	for D in $DIRS; do
+		for US in $PERIODS; do
+			make -s clean
+			make -s PMEM_DIR=$D MSYNC_COMMIT_US=$US $APP
+			cleanup $D
+			echo "directory $D, msync period $US us"
+			./$APP -y adr-group,msync $ARGS
+			cleanup $D
+			sleep 2
+		done
+	done
+
+	# Leave the default build behind
+	make -s clean
+	make -s
+}
+
+main $@
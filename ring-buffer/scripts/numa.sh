@@ -0,0 +1,47 @@
+#!/bin/bash
+### Compare a single RB queue with the NUMA-sharded queue on all sockets.
+### Usage: ./numa.sh [RUNS]
+### Example: ./numa.sh 5
+### Shard mounts follow NUMA_NODES and PMEM_NODE_PATHS in include/config.h.
+
+# PMEM Directory of the single queue
+: ${PMEM_DIR:="/mnt/pmem1"}
+
+# DAX mounts of the shards, one per node
+: ${PMEM_NODE_DIRS:="/mnt/pmem0 /mnt/pmem1"}
+
+function cleanup()
+{
+	rm -f $PMEM_DIR/queue
+	for D in $PMEM_NODE_DIRS; do
+		rm -f $D/pool
+	done
+}
+
+function run()
+{
+	local NAME=$1
+	shift
+	local APP=$@
+
+	echo "$NAME"
+	for i in $(seq 1 $RUNS); do
+		cleanup
+		$APP | grep "took\|Stole"
+		sleep 2
+	done
+	cleanup
+}
+
+function main()
+{
+	RUNS=${1:-5}
+
+	# Threads float over all nodes, as on a shared two-socket host.
+	run TX-free-eADR ./p_rb_q_eadr.x true
+	run TX-free-eADR-sharded ./p_rb_q_eadr.x numa
+	run TX-free-ADR ./p_rb_q_exp.x true
+	run TX-free-ADR-sharded ./p_rb_q_exp.x numa
+}
+
+main $@
@@ -0,0 +1,43 @@
+#!/bin/bash
+### Run a RB queue under every thread placement policy and print test times.
+### Usage: ./placement.sh [APP] [APP args]
+### Example: ./placement.sh p_rb_q_eadr.x false
+### Set ARRAY_NODE to first-touch the volatile slot array on that node.
+
+# PMEM Directory
+: ${PMEM_DIR:="/mnt/pmem1"}
+
+# Placement policies to test
+: ${POLICIES:="none compact scatter split"}
+
+function cleanup()
+{
+	rm -f $PMEM_DIR/queue
+}
+
+function main()
+{
+	APP=${1:-p_rb_q_eadr.x}
+	shift
+	ARGS=${@:-true}
+
+	echo -e "policy\tsmt\tresult"
+	for P in $POLICIES; do
+		for SMT in y n; do
+			make -s clean
+			make -s PIN_POLICY=$P PIN_SMT=$SMT \
+				${ARRAY_NODE:+ARRAY_NODE=$ARRAY_NODE} $APP
+			cleanup
+			echo -ne "$P\t$SMT\t"
+			./$APP $ARGS | grep took
+			cleanup
+			sleep 2
+		done
+	done
+
+	# Leave the default build behind
+	make -s clean
+	make -s
+}
+
+main $@
@@ -0,0 +1,41 @@
+#!/bin/bash
+### Crash each persistent RB queue and measure time to first push after restart.
+### Usage: ./recovery_time.sh [CRASH_AFTER_MS] [RUNS]
+### Example: ./recovery_time.sh 100 5
+### The pool size follows QUEUE_SIZE and SLOT_SIZE in include/config.h.
+
+# PMEM Directory
+: ${PMEM_DIR:="/mnt/pmem1"}
+
+function cleanup()
+{
+	rm -f $PMEM_DIR/queue
+}
+
+function crash_and_recover()
+{
+	local NAME=$1
+	shift
+	local APP=$@
+
+	echo "$NAME"
+	cleanup
+	for i in $(seq 1 $RUNS); do
+		$APP crash $CRASH_AFTER > /dev/null 2>&1
+		$APP recover | grep "took\|First push"
+	done
+	cleanup
+	sleep 2
+}
+
+function main()
+{
+	CRASH_AFTER=${1:-100}
+	RUNS=${2:-5}
+
+	crash_and_recover TX-free-eADR numactl -N 0 ./p_rb_q_eadr.x
+	crash_and_recover TX-free-ADR numactl -N 0 ./p_rb_q_exp.x
+	crash_and_recover TX-ADR numactl -N 0 ./p_rb_q_adr.x
+}
+
+main $@
@@ -6,7 +6,7 @@
 export PMEM_DIR="/mnt/pmem1" # PMEM directory
 export PMIDIOBENCH_HOME="../Bench" # PMIdioBench install dir
 
-SLOT_SIZE=$(grep SLOT_SIZE include/config.h | awk '{ print $3 }')
+SLOT_SIZE=$(grep "define SLOT_SIZE" include/config.h | awk '{ print $3 }')
 
 # Run push test
 make clean
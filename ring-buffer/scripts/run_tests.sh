@@ -28,38 +28,19 @@ function tool_cmdline()
 	fi
 }
 
-function get_tail_lat()
-{
-	# File containing sorted lat values
-	file=$1
-	# Tail latency to calculate (e.g., 99.9)
-	tail_lat=$2
-
-	# Find line no
-	lines=$(wc -l $file | awk '{ print $1 }')
-	line_no=$(echo "$lines*$tail_lat/100" | bc)
-
-	# Print tail latency
-	if [ $line_no -gt 0 ]; then
-		sed -n "$line_no"p $file
-	else
-		echo "Unknown"
-	fi
-}
-
 function get_stats()
 {
-	# Consider the first 100000 operations as warm up
-	grep -v ms output.log | tail -n +100000 > $1
-	sort -n --parallel=$(nproc) $1 > $1-sorted
-	mv -f $1-sorted $1
-
-	# Get latency results
-	avg_lat=$(awk '{ total += $1; count++ } END { if (count > 0) { print total/count } }' $1)
-	p99_lat=$(get_tail_lat $1 99)
-	p99_9_lat=$(get_tail_lat $1 99.9)
-
-	echo -e "$2\t$avg_lat\t$p99_lat\t$p99_9_lat"
+	# The queue prints a merged latency histogram summary per operation,
+	# warm-up excluded: "LAT push n N avg A p50 B p99 C ... max M"
+	local OP=$(echo $TEST | tr A-Z a-z)
+	grep "^LAT $OP " output.log > $1
+
+	awk -v sys=$2 '{
+		for (i = 3; i < NF; i += 2)
+			v[$i] = $(i + 1)
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n", sys, v["avg"], v["p50"],
+		       v["p99"], v["p99.9"], v["p99.99"], v["max"]
+	}' $1
 }
 
 function cleanup()
@@ -87,7 +68,7 @@ function main()
 
 	if [[ "$GET_STATS" == "true" ]]; then
 		echo "$TEST latency (in cycles)"
-		echo -e "system\tavg\tp99\tp99.9"
+		echo -e "system\tavg\tp50\tp99\tp99.9\tp99.99\tmax"
 	fi
 
 	# Volatile Queue
@@ -130,6 +111,34 @@ function main()
 	cleanup
 	sleep 5
 
+	# Persistent TX-free (ADR) Queue with one cache line per thread role
+	$(tool_cmdline $TOOL tx-free-adr-compact-$SIZE p_rb_q_exp.x) \
+	numactl -N 0 ./p_rb_q_exp.x true compact > output.log 2>&1
+	sleep 2
+	if [[ "$GET_STATS" == "true" ]]; then
+		get_stats $TEST-lat-tx-free-adr-compact-$SIZE.log TX-free-ADR-compact
+	else
+		echo "TX-free-ADR-compact"
+		cat output.log
+	fi
+	sleep 2
+	cleanup
+	sleep 5
+
+	# Persistent TX-free (ADR) Queue with variable-length records
+	$(tool_cmdline $TOOL tx-free-adr-var-$SIZE p_rb_q_var.x) \
+	numactl -N 0 ./p_rb_q_var.x true > output.log 2>&1
+	sleep 2
+	if [[ "$GET_STATS" == "true" ]]; then
+		get_stats $TEST-lat-tx-free-adr-var-$SIZE.log TX-free-ADR-var
+	else
+		echo "TX-free-ADR-var"
+		cat output.log
+	fi
+	sleep 2
+	cleanup
+	sleep 5
+
 	# Persistent TX (eADR) Queue
 	PMEM_NO_FLUSH=1 $(tool_cmdline $TOOL tx-eadr-$SIZE p_rb_q_adr.x) \
 	numactl -N 0 ./p_rb_q_adr.x > output.log 2>&1
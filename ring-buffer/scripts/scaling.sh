@@ -0,0 +1,32 @@
+#!/bin/bash
+### Run the RB queue with 1 to 128 threads per side and print the JSON
+### results of p_rb_q_bench.x, one object per policy and thread count.
+### Usage: ./scaling.sh [bench args]
+### Example: ./scaling.sh -y eadr,adr-group -s 256 -d 5000
+
+# PMEM Directory
+: ${PMEM_DIR:="/mnt/pmem1"}
+
+# Producers (and consumers) to test with
+: ${THREADS:="1 2 4 8 14 16 28 32 56 64 112 128"}
+
+function cleanup()
+{
+	rm -f $PMEM_DIR/bench $PMEM_DIR/queue
+}
+
+function main()
+{
+	APP=p_rb_q_bench.x
+	ARGS=${@:--y eadr}
+
+	[ -x $APP ] || make -s $APP
+	for T in $THREADS; do
+		cleanup
+		./$APP -p $T -c $T $ARGS
+		cleanup
+		sleep 2
+	done
+}
+
+main $@
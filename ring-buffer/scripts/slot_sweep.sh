@@ -0,0 +1,49 @@
+#!/bin/bash
+### Sweep RB queue slot sizes with and without XPLine padding.
+### Usage: ./slot_sweep.sh [APP] [APP args]
+### Example: TOOL=ipmw ./slot_sweep.sh p_rb_q_exp.x true
+
+# PMEM Directory
+: ${PMEM_DIR:="/mnt/pmem1"}
+
+# Slot sizes to test with
+: ${SIZES:="64 128 192 256 512 1024 2048 4096"}
+
+# Analysis Tool
+: ${TOOL:=""} # ipmw for media write amplification and bandwidth
+
+function cleanup()
+{
+	rm -f $PMEM_DIR/queue
+}
+
+function main()
+{
+	APP=${1:-p_rb_q_exp.x}
+	shift
+	ARGS=${@:-true}
+
+	if [ "$TOOL" == "ipmw" ]; then
+		CMD="scripts/ipmw.sh"
+	else
+		CMD=""
+	fi
+
+	for S in $SIZES; do
+		for PAD in y n; do
+			make -s clean
+			make -s SLOT_SIZE=$S XPLINE_SLOTS=$PAD $APP
+			cleanup
+			echo "slot size $S, XPLine padding $PAD"
+			$CMD numactl -N 0 ./$APP $ARGS
+			cleanup
+			sleep 2
+		done
+	done
+
+	# Leave the default build behind
+	make -s clean
+	make -s
+}
+
+main $@